@@ -0,0 +1,335 @@
+# pragma once
+# include "png.hpp"
+# include <filesystem>
+# include <functional>
+# include <charconv>
+# include <list>
+# include <unordered_map>
+# include <unistd.h>
+
+namespace png {
+namespace utils{
+  // SHA-256(FIPS 180-4)の64桁の16進文字列。キャッシュキーは衝突を作られないよう暗号学的ハッシュにする
+  inline std::string sha256_hex(const char* data, const size_t size){
+    static constexpr std::array<uint32_t, 64> K{
+      0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+      0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+      0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+      0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+      0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+      0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+      0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+      0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+    };
+    std::array<uint32_t, 8> state{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    const auto rotr = [](const uint32_t x, const int n){ return (x >> n) | (x << (32 - n)); };
+    const auto compress = [&](const uint8_t* block){
+      std::array<uint32_t, 64> w;
+      for(size_t i = 0; i < 16; i++){
+        w[i] = (uint32_t(block[i * 4]) << 24) | (uint32_t(block[i * 4 + 1]) << 16) | (uint32_t(block[i * 4 + 2]) << 8) | block[i * 4 + 3];
+      }
+      for(size_t i = 16; i < 64; i++){
+        const uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        const uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+      }
+      uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+      for(size_t i = 0; i < 64; i++){
+        const uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+        const uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+      }
+      state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+      state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    };
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+    size_t offset = 0;
+    for(; offset + 64 <= size; offset += 64) compress(bytes + offset);
+    // 残りに0x80と0埋め、末尾にビット長を付けて1〜2ブロックにする
+    std::array<uint8_t, 128> tail{};
+    const size_t rest = size - offset;
+    std::memcpy(tail.data(), bytes + offset, rest);
+    tail[rest] = 0x80;
+    const size_t tail_size = rest < 56 ? 64 : 128;
+    const uint64_t bits = static_cast<uint64_t>(size) * 8;
+    for(size_t i = 0; i < 8; i++) tail[tail_size - 1 - i] = static_cast<uint8_t>(bits >> (i * 8));
+    for(size_t i = 0; i < tail_size; i += 64) compress(tail.data() + i);
+    static constexpr char digits[] = "0123456789abcdef";
+    std::string res(64, '0');
+    for(size_t i = 0; i < 8; i++){
+      for(size_t j = 0; j < 8; j++) res[i * 8 + j] = digits[(state[i] >> (28 - j * 4)) & 0xF];
+    }
+    return res;
+  }
+  // fromの内容をtoに書き込む。copy_fileと違って権限を写さないので、新しいファイルはPNG::writeと同じくumaskに従う
+  inline bool copy_contents(const std::filesystem::path& from, const std::filesystem::path& to){
+    std::ifstream ifs(from, std::ios::in | std::ios::binary);
+    if(!ifs) return false;
+    std::ofstream ofs(to, std::ios::out | std::ios::binary | std::ios::trunc);
+    if(!ofs) return false;
+    ofs << ifs.rdbuf();
+    ofs.close();
+    return !ifs.bad() && static_cast<bool>(ofs);
+  }
+  // 64ビット整数を16桁の16進文字列に変換
+  inline std::string hex64(const uint64_t value){
+    char buffer[16];
+    const std::to_chars_result res = std::to_chars(buffer, buffer + 16, value, 16);
+    return std::string(16 - (res.ptr - buffer), '0') + std::string(buffer, res.ptr);
+  }
+  // 実数を丸めなしの16進表記に変換(キャッシュキー用)
+  inline std::string exact_double(const double value){
+    char buffer[32];
+    const std::to_chars_result res = std::to_chars(buffer, buffer + 32, value, std::chars_format::hex);
+    return std::string(buffer, res.ptr);
+  }
+}
+
+// PNGへの操作列。正規化した文字列表現がキャッシュキーになる
+class OperationChain{
+private:
+  std::string canonical_;
+  std::vector<std::function<void(PNG&)>> operations_;
+public:
+  // canonicalは操作と引数を一意に表す文字列
+  OperationChain& add(const std::string& canonical, std::function<void(PNG&)> operation){
+    canonical_ += canonical + ";";
+    operations_.push_back(std::move(operation));
+    return *this;
+  }
+  OperationChain& set_index_interval(const uint32_t& interval){
+    return add("set_index_interval(" + std::to_string(interval) + ")", [=](PNG& png){ png.set_index_interval(interval); });
+  }
+  OperationChain& set_palette_colors(const uint16_t& max_colors){
+    return add("set_palette_colors(" + std::to_string(max_colors) + ")", [=](PNG& png){ png.set_palette_colors(max_colors); });
+  }
+  OperationChain& set_optimize(const bool& enabled, const uint32_t& time_budget_ms = 0){
+    return add(
+      "set_optimize(" + std::to_string(enabled) + "," + std::to_string(time_budget_ms) + ")",
+      [=](PNG& png){ png.set_optimize(enabled, time_budget_ms); }
+    );
+  }
+  OperationChain& reverse_color(void){
+    return add("reverse_color()", [](PNG& png){ png.reverse_color(); });
+  }
+  OperationChain& apply(const PointwiseOps& ops){
+    // LUTの中身そのものをキーにする
+    std::string stages;
+    for(const PointwiseOps::Stage& stage : ops.stages()){
+      stages.push_back(stage.grayscale ? 1 : 0);
+      stages.append(stage.source.begin(), stage.source.end());
+      for(const std::array<uint8_t, 256>& table : stage.lut) stages.append(table.begin(), table.end());
+    }
+    return add(
+      "apply(" + utils::sha256_hex(stages.data(), stages.size()) + ")",
+      [=](PNG& png){ png.apply(ops); }
+    );
+  }
+  OperationChain& auto_levels(const double& clip = 0.0){
+    return add("auto_levels(" + utils::exact_double(clip) + ")", [=](PNG& png){ png.auto_levels(clip); });
+  }
+  OperationChain& resize_data(const double& scale_height, const double& scale_width){
+    return add(
+      "resize_data(" + utils::exact_double(scale_height) + "," + utils::exact_double(scale_width) + ")",
+      [=](PNG& png){ png.resize_data(scale_height, scale_width); }
+    );
+  }
+  OperationChain& blit(const std::vector<BlitOp>& ops){
+    std::string canonical = "blit(";
+    for(const BlitOp& op : ops){
+      canonical += std::to_string(op.src.y) + "," + std::to_string(op.src.x) + "," + std::to_string(op.src.height) + ","
+                   + std::to_string(op.src.width) + "," + std::to_string(op.dst_y) + "," + std::to_string(op.dst_x) + "|";
+    }
+    return add(canonical + ")", [=](PNG& png){ png.blit(ops); });
+  }
+  // 乱数を使う操作はseedを指定した場合だけキャッシュできる
+  OperationChain& collapse(const int& shuffle_num, const uint64_t& seed){
+    return add(
+      "collapse(" + std::to_string(shuffle_num) + "," + std::to_string(seed) + ")",
+      [=](PNG& png){ png.collapse(shuffle_num, seed); }
+    );
+  }
+  OperationChain& rotate(const int& degree){
+    return add("rotate(" + std::to_string(((degree % 360) + 360) % 360) + ")", [=](PNG& png){ png.rotate(degree); });
+  }
+  OperationChain& flip_horizontal(void){
+    return add("flip_horizontal()", [](PNG& png){ png.flip_horizontal(); });
+  }
+  OperationChain& flip_vertical(void){
+    return add("flip_vertical()", [](PNG& png){ png.flip_vertical(); });
+  }
+  OperationChain& transpose(void){
+    return add("transpose()", [](PNG& png){ png.transpose(); });
+  }
+  OperationChain& crop(const uint32_t& y, const uint32_t& x, const uint32_t& height, const uint32_t& width){
+    return add(
+      "crop(" + std::to_string(y) + "," + std::to_string(x) + "," + std::to_string(height) + "," + std::to_string(width) + ")",
+      [=](PNG& png){ png.crop(y, x, height, width); }
+    );
+  }
+  OperationChain& convolve(const std::vector<double>& kernel_x, const std::vector<double>& kernel_y){
+    std::string canonical = "convolve(";
+    for(const double weight : kernel_x) canonical += utils::exact_double(weight) + ",";
+    canonical += "|";
+    for(const double weight : kernel_y) canonical += utils::exact_double(weight) + ",";
+    return add(canonical + ")", [=](PNG& png){ png.convolve(kernel_x, kernel_y); });
+  }
+  OperationChain& box_blur(const uint32_t& radius){
+    return add("box_blur(" + std::to_string(radius) + ")", [=](PNG& png){ png.box_blur(radius); });
+  }
+  OperationChain& gaussian_blur(const double& sigma){
+    return add("gaussian_blur(" + utils::exact_double(sigma) + ")", [=](PNG& png){ png.gaussian_blur(sigma); });
+  }
+  OperationChain& unsharp_mask(const double& sigma, const double& amount, const uint8_t& threshold = 0){
+    return add(
+      "unsharp_mask(" + utils::exact_double(sigma) + "," + utils::exact_double(amount) + "," + std::to_string(threshold) + ")",
+      [=](PNG& png){ png.unsharp_mask(sigma, amount, threshold); }
+    );
+  }
+  void run(PNG& png) const{
+    for(const std::function<void(PNG&)>& operation : operations_) operation(png);
+  }
+  const std::string& canonical() const { return canonical_; }
+};
+
+// 入力ファイルの内容と操作列をキーに、出力PNGをディスクに保存するキャッシュ
+class ResultCache{
+private:
+  // 処理内容が変わったときはこの値を上げて古いエントリを無効にする
+  static constexpr const char* VERSION = "1";
+  static constexpr std::chrono::hours TEMPORARY_LIFETIME{1}; // これより古い一時ファイルは書き込み途中で止まったものとみなす
+  std::filesystem::path directory_;
+  uint64_t max_bytes_ = 0; // キャッシュ全体の上限サイズ
+  uint64_t total_bytes_ = 0;
+  std::list<std::string> lru_; // 先頭ほど最近使われたキー
+  std::unordered_map<std::string, std::pair<std::list<std::string>::iterator, uint64_t>> entries_; // キー→(LRU位置, サイズ)
+  std::atomic<uint64_t> hits_{0};
+  std::atomic<uint64_t> misses_{0};
+  std::mutex mutex_;
+  std::filesystem::path entry_path(const std::string& key) const { return directory_ / (key + ".png"); }
+  void touch(const std::string& key); // 最近使われたものとして先頭に移動
+  void insert(const std::string& key, const uint64_t size); // エントリを登録し、上限を超えた分を古い順に削除
+public:
+  ResultCache(const std::filesystem::path& directory, const uint64_t& max_bytes);
+  // input_pathにchainを適用した結果をoutput_pathに書き込む。キャッシュにあれば復号せずにコピーしてtrueを返す
+  bool run(const std::string& input_path, const std::string& output_path, const OperationChain& chain);
+  uint64_t hits(void) const { return hits_; }
+  uint64_t misses(void) const { return misses_; }
+  uint64_t total_bytes(void) const { return total_bytes_; }
+};
+
+ResultCache::ResultCache(const std::filesystem::path& directory, const uint64_t& max_bytes)
+  : directory_(directory), max_bytes_(max_bytes){
+  std::filesystem::create_directories(directory_);
+  // 既存のエントリを最終使用時刻(更新時刻)の新しい順に読み込む
+  // 異常終了で残った一時ファイルは上限サイズの計算に入らないので消す。他のプロセスが書き込み中のものは残すよう、古いものだけ
+  const std::filesystem::file_time_type stale = std::filesystem::file_time_type::clock::now() - TEMPORARY_LIFETIME;
+  std::vector<std::pair<std::filesystem::file_time_type, std::filesystem::directory_entry>> existing;
+  for(const std::filesystem::directory_entry& entry : std::filesystem::directory_iterator(directory_)){
+    if(!entry.is_regular_file()) continue;
+    if(entry.path().extension() == ".png"){
+      existing.emplace_back(entry.last_write_time(), entry);
+    }else if(entry.path().extension().string().starts_with(".tmp") && entry.last_write_time() < stale){
+      std::error_code ec;
+      std::filesystem::remove(entry.path(), ec);
+    }
+  }
+  std::sort(existing.begin(), existing.end(), [](const auto& a, const auto& b){ return a.first > b.first; });
+  for(const auto& [time, entry] : existing){
+    const std::string key = entry.path().stem().string();
+    lru_.push_back(key);
+    entries_[key] = {std::prev(lru_.end()), entry.file_size()};
+    total_bytes_ += entry.file_size();
+  }
+}
+
+void ResultCache::touch(const std::string& key){
+  lru_.splice(lru_.begin(), lru_, entries_.at(key).first);
+  std::error_code ec;
+  std::filesystem::last_write_time(entry_path(key), std::filesystem::file_time_type::clock::now(), ec);
+}
+
+void ResultCache::insert(const std::string& key, const uint64_t size){
+  if(entries_.count(key)){
+    total_bytes_ -= entries_[key].second;
+    lru_.erase(entries_[key].first);
+  }
+  lru_.push_front(key);
+  entries_[key] = {lru_.begin(), size};
+  total_bytes_ += size;
+  while(total_bytes_ > max_bytes_ && lru_.size() > 1){
+    const std::string& oldest = lru_.back();
+    std::error_code ec;
+    std::filesystem::remove(entry_path(oldest), ec);
+    total_bytes_ -= entries_[oldest].second;
+    entries_.erase(oldest);
+    lru_.pop_back();
+  }
+}
+
+bool ResultCache::run(const std::string& input_path, const std::string& output_path, const OperationChain& chain){
+  // キー: 入力内容のSHA-256・サイズと、操作列(エンコード設定を含む)のSHA-256
+  std::ifstream ifs(input_path, std::ios::in | std::ios::binary);
+  if(!ifs){
+    throw std::runtime_error("Failed to open input file");
+  }
+  const std::vector<char> input((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+  const std::string canonical = std::string(VERSION) + ":" + chain.canonical();
+  const std::string key = utils::sha256_hex(input.data(), input.size())
+                          + "-" + utils::hex64(input.size())
+                          + "-" + utils::sha256_hex(canonical.data(), canonical.size());
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if(entries_.count(key)){
+      // キャッシュのエントリはmkstempで作った0600なので、権限ごと写さない
+      if(utils::copy_contents(entry_path(key), output_path)){
+        touch(key);
+        hits_++;
+        return true;
+      }
+      if(std::filesystem::exists(entry_path(key))){
+        throw std::runtime_error("Failed to write output file");
+      }
+      // 他のプロセスに消されていたら取りこぼしとして扱う
+      total_bytes_ -= entries_[key].second;
+      lru_.erase(entries_[key].first);
+      entries_.erase(key);
+    }
+  }
+  misses_++;
+  // ハッシュを取った内容そのものから復号する(読み直すと、その間にファイルが変わったとき別の内容の結果を登録してしまう)
+  PNG png{input};
+  chain.run(png);
+  // 一時ファイルに書いてから名前を変えることで、壊れたエントリが見えないようにする
+  // 名前はmkstempで作るので、ディレクトリを共有する他のプロセス・スレッドと重ならない
+  std::string temporary = (directory_ / (key + ".tmpXXXXXX")).string();
+  const int fd = mkstemp(temporary.data());
+  if(fd < 0){
+    throw std::runtime_error("Failed to create temporary file");
+  }
+  close(fd);
+  uint64_t size = 0;
+  try{
+    png.write(temporary);
+    if(!utils::copy_contents(temporary, output_path)){
+      throw std::runtime_error("Failed to write output file");
+    }
+    size = std::filesystem::file_size(temporary);
+  }catch(...){
+    std::error_code ec;
+    std::filesystem::remove(temporary, ec);
+    throw;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::error_code ec;
+  std::filesystem::rename(temporary, entry_path(key), ec);
+  if(ec){
+    // 出力は書けているので、登録できなかった一時ファイルだけ片付ける
+    std::filesystem::remove(temporary, ec);
+    return false;
+  }
+  insert(key, size);
+  return false;
+}
+
+} // namespace png
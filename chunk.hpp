@@ -7,6 +7,8 @@
 # include <vector>
 # include <algorithm>
 # include <cassert>
+# include <utility>
+# include <variant>
 # include <zlib.h>
 
 namespace png{
@@ -34,6 +36,20 @@ namespace utils{
       static_cast<char>((number >> 0) & 0xFF)
     };
   }
+  // バイト列(ビッグエンディアン)を整数に変換
+  inline uint32_t vecchar2int(const char* ptr) noexcept {
+    return (static_cast<uint32_t>(static_cast<uint8_t>(ptr[0])) << 24)
+           | (static_cast<uint32_t>(static_cast<uint8_t>(ptr[1])) << 16)
+           | (static_cast<uint32_t>(static_cast<uint8_t>(ptr[2])) << 8)
+           |  static_cast<uint32_t>(static_cast<uint8_t>(ptr[3]));
+  }
+  // 4文字のチャンク名をビッグエンディアンの整数タグに変換
+  constexpr uint32_t fourcc(const char (&name)[5]) noexcept {
+    return (static_cast<uint32_t>(static_cast<uint8_t>(name[0])) << 24)
+           | (static_cast<uint32_t>(static_cast<uint8_t>(name[1])) << 16)
+           | (static_cast<uint32_t>(static_cast<uint8_t>(name[2])) << 8)
+           |  static_cast<uint32_t>(static_cast<uint8_t>(name[3]));
+  }
   // CRC計算
   inline uint32_t calc_crc(const std::vector<char>& data, size_t start, size_t length) noexcept {
     uint32_t crc = UINT32_C(0xFFFFFFFF);
@@ -49,6 +65,23 @@ namespace utils{
   }
 }
 
+// チャンクタイプのタグ(チャンク名は大文字小文字で意味が変わるので区別する)
+constexpr uint32_t TYPE_IHDR = utils::fourcc("IHDR");
+constexpr uint32_t TYPE_PLTE = utils::fourcc("PLTE");
+constexpr uint32_t TYPE_sRGB = utils::fourcc("sRGB");
+constexpr uint32_t TYPE_tEXt = utils::fourcc("tEXt");
+constexpr uint32_t TYPE_tEXT = utils::fourcc("tEXT"); // 以前このライブラリが書き出していた名前
+constexpr uint32_t TYPE_tRNS = utils::fourcc("tRNS");
+constexpr uint32_t TYPE_bKGD = utils::fourcc("bKGD");
+constexpr uint32_t TYPE_hIST = utils::fourcc("hIST");
+constexpr uint32_t TYPE_IDAT = utils::fourcc("IDAT");
+constexpr uint32_t TYPE_IEND = utils::fourcc("IEND");
+constexpr uint32_t TYPE_pIdX = utils::fourcc("pIdX"); // 2文字目が小文字の私的チャンク
+constexpr uint32_t TYPE_pIDX = utils::fourcc("pIDX"); // 以前このライブラリが書き出していた名前
+constexpr uint32_t TYPE_acTL = utils::fourcc("acTL");
+constexpr uint32_t TYPE_fcTL = utils::fourcc("fcTL");
+constexpr uint32_t TYPE_fdAT = utils::fourcc("fdAT");
+
 // チャンクデータのインターフェース
 class ChunkDataInterface{
 public:
@@ -338,7 +371,260 @@ public:
   void debug() const override {}
 };
 
-using ChunkData = std::variant<IHDR, PLTE, sRGB, tEXT, IDAT, IEND>;
+// pIdXチャンク(独自): 全フラッシュ位置の索引
+// 各区間はzlibストリーム上のバイト境界から始まり、先頭行は上の行を参照しないフィルタを使う
+// 4文字目が大文字(コピー不可)なので、画像を書き換えた他ツールはこのチャンクを破棄する
+class pIdX : public BaseChunkData{
+private:
+  uint32_t interval_ = 0; // 区間あたりの行数
+  std::vector<std::pair<uint32_t, uint32_t>> entries_; // (区間の開始行, 連結IDAT上のオフセット)
+public:
+  pIdX() = default;
+  pIdX(const uint32_t length, const std::vector<char>& data){
+    set(length, data);
+  }
+  void set(const uint32_t length, const std::vector<char>& data) override{
+    assert(length >= 4 && (length - 4) % 8 == 0);
+    length_ = length;
+    data_raw_ = data;
+    const char* ptr = data.data();
+    interval_ = utils::vecchar2int(ptr);
+    const size_t num_entries = (length - 4) / 8;
+    entries_.resize(num_entries);
+    for(size_t i = 0; i < num_entries; i++){
+      entries_[i] = {
+        utils::vecchar2int(ptr + 4 + i*8),
+        utils::vecchar2int(ptr + 8 + i*8)
+      };
+    }
+  }
+  inline std::vector<char> get() const override{
+    std::vector<char> res;
+    res.reserve(4 + entries_.size() * 8);
+    const std::vector<char> interval_bytes = utils::int2vecchar(interval_);
+    res.insert(res.end(), interval_bytes.begin(), interval_bytes.end());
+    for(const std::pair<uint32_t, uint32_t>& entry : entries_){
+      const std::vector<char> row_bytes = utils::int2vecchar(entry.first);
+      const std::vector<char> offset_bytes = utils::int2vecchar(entry.second);
+      res.insert(res.end(), row_bytes.begin(), row_bytes.end());
+      res.insert(res.end(), offset_bytes.begin(), offset_bytes.end());
+    }
+    return res;
+  }
+  void clear() override{
+    BaseChunkData::clear();
+    interval_ = 0;
+    entries_.clear();
+  }
+  void debug() const override{
+    std::cout << std::format("\tinterval: {:08X}", interval_) << std::endl;
+    for(const std::pair<uint32_t, uint32_t>& entry : entries_){
+      std::cout << std::format("\t\trow:{:08X} offset:{:08X}", entry.first, entry.second) << std::endl;
+    }
+  }
+  // ゲッター
+  uint32_t& interval() { return interval_; }
+  const uint32_t& interval() const { return interval_; }
+  std::vector<std::pair<uint32_t, uint32_t>>& entries() { return entries_; }
+  const std::vector<std::pair<uint32_t, uint32_t>>& entries() const { return entries_; }
+};
+
+// acTLチャンク(APNG): アニメーションの制御
+class acTL : public BaseChunkData{
+private:
+  uint32_t num_frames_ = 0; // フレーム数
+  uint32_t num_plays_ = 0; // ループ回数(0なら無限)
+public:
+  acTL() = default;
+  acTL(const uint32_t length, const std::vector<char>& data){
+    set(length, data);
+  }
+  void set(const uint32_t length, const std::vector<char>& data) override{
+    assert(length == 8);
+    length_ = length;
+    data_raw_ = data;
+    num_frames_ = utils::vecchar2int(data.data());
+    num_plays_ = utils::vecchar2int(data.data() + 4);
+  }
+  inline std::vector<char> get() const override{
+    std::vector<char> res = utils::int2vecchar(num_frames_);
+    const std::vector<char> plays_bytes = utils::int2vecchar(num_plays_);
+    res.insert(res.end(), plays_bytes.begin(), plays_bytes.end());
+    return res;
+  }
+  void clear() override{
+    BaseChunkData::clear();
+    num_frames_ = 0;
+    num_plays_ = 0;
+  }
+  void debug() const override{
+    std::cout << std::format("\tnum_frames: {:08X}", num_frames_) << std::endl;
+    std::cout << std::format("\t num_plays: {:08X}", num_plays_) << std::endl;
+  }
+  // ゲッター
+  uint32_t& num_frames() { return num_frames_; }
+  const uint32_t& num_frames() const { return num_frames_; }
+  uint32_t& num_plays() { return num_plays_; }
+  const uint32_t& num_plays() const { return num_plays_; }
+};
+
+// fcTLチャンク(APNG): フレームの位置・表示時間・合成方法
+class fcTL : public BaseChunkData{
+private:
+  uint32_t sequence_number_ = 0; // fcTL・fdAT共通の通し番号
+  uint32_t width_ = 0; // フレームの幅
+  uint32_t height_ = 0; // フレームの高さ
+  uint32_t x_offset_ = 0; // フレームの左端
+  uint32_t y_offset_ = 0; // フレームの上端
+  uint16_t delay_num_ = 0; // 表示時間の分子
+  uint16_t delay_den_ = 0; // 表示時間の分母(0なら1/100秒単位)
+  uint8_t dispose_op_ = 0; // 表示後の処理(0:そのまま, 1:背景で消去, 2:直前の状態に戻す)
+  uint8_t blend_op_ = 0; // 合成方法(0:上書き, 1:アルファ合成)
+  static uint16_t read16(const char* ptr) noexcept {
+    return static_cast<uint16_t>((static_cast<uint8_t>(ptr[0]) << 8) | static_cast<uint8_t>(ptr[1]));
+  }
+public:
+  static constexpr uint8_t DISPOSE_NONE = 0;
+  static constexpr uint8_t DISPOSE_BACKGROUND = 1;
+  static constexpr uint8_t DISPOSE_PREVIOUS = 2;
+  static constexpr uint8_t BLEND_SOURCE = 0;
+  static constexpr uint8_t BLEND_OVER = 1;
+  fcTL() = default;
+  fcTL(const uint32_t length, const std::vector<char>& data){
+    set(length, data);
+  }
+  void set(const uint32_t length, const std::vector<char>& data) override{
+    assert(length == 26);
+    length_ = length;
+    data_raw_ = data;
+    const char* ptr = data.data();
+    sequence_number_ = utils::vecchar2int(ptr);
+    width_           = utils::vecchar2int(ptr + 4);
+    height_          = utils::vecchar2int(ptr + 8);
+    x_offset_        = utils::vecchar2int(ptr + 12);
+    y_offset_        = utils::vecchar2int(ptr + 16);
+    delay_num_       = read16(ptr + 20);
+    delay_den_       = read16(ptr + 22);
+    dispose_op_      = static_cast<uint8_t>(ptr[24]);
+    blend_op_        = static_cast<uint8_t>(ptr[25]);
+  }
+  inline std::vector<char> get() const override{
+    std::vector<char> res;
+    res.reserve(26);
+    for(const uint32_t value : {sequence_number_, width_, height_, x_offset_, y_offset_}){
+      const std::vector<char> bytes = utils::int2vecchar(value);
+      res.insert(res.end(), bytes.begin(), bytes.end());
+    }
+    for(const uint16_t value : {delay_num_, delay_den_}){
+      res.push_back(static_cast<char>((value >> 8) & 0xFF));
+      res.push_back(static_cast<char>(value & 0xFF));
+    }
+    res.push_back(static_cast<char>(dispose_op_));
+    res.push_back(static_cast<char>(blend_op_));
+    return res;
+  }
+  void clear() override{
+    BaseChunkData::clear();
+    sequence_number_ = 0;
+    width_ = 0;
+    height_ = 0;
+    x_offset_ = 0;
+    y_offset_ = 0;
+    delay_num_ = 0;
+    delay_den_ = 0;
+    dispose_op_ = 0;
+    blend_op_ = 0;
+  }
+  void debug() const override{
+    std::cout << std::format("\tsequence_number: {:08X}", sequence_number_) << std::endl;
+    std::cout << std::format("\t          width: {:08X}", width_) << std::endl;
+    std::cout << std::format("\t         height: {:08X}", height_) << std::endl;
+    std::cout << std::format("\t       x_offset: {:08X}", x_offset_) << std::endl;
+    std::cout << std::format("\t       y_offset: {:08X}", y_offset_) << std::endl;
+    std::cout << std::format("\t      delay_num: {:04X}", delay_num_) << std::endl;
+    std::cout << std::format("\t      delay_den: {:04X}", delay_den_) << std::endl;
+    std::cout << std::format("\t     dispose_op: {:01X}", dispose_op_) << std::endl;
+    std::cout << std::format("\t       blend_op: {:01X}", blend_op_) << std::endl;
+  }
+  // ゲッター
+  uint32_t& sequence_number() { return sequence_number_; }
+  const uint32_t& sequence_number() const { return sequence_number_; }
+  uint32_t& width() { return width_; }
+  const uint32_t& width() const { return width_; }
+  uint32_t& height() { return height_; }
+  const uint32_t& height() const { return height_; }
+  uint32_t& x_offset() { return x_offset_; }
+  const uint32_t& x_offset() const { return x_offset_; }
+  uint32_t& y_offset() { return y_offset_; }
+  const uint32_t& y_offset() const { return y_offset_; }
+  uint16_t& delay_num() { return delay_num_; }
+  const uint16_t& delay_num() const { return delay_num_; }
+  uint16_t& delay_den() { return delay_den_; }
+  const uint16_t& delay_den() const { return delay_den_; }
+  uint8_t& dispose_op() { return dispose_op_; }
+  const uint8_t& dispose_op() const { return dispose_op_; }
+  uint8_t& blend_op() { return blend_op_; }
+  const uint8_t& blend_op() const { return blend_op_; }
+};
+
+// fdATチャンク(APNG): 通し番号付きのフレーム画像データ(IDATと同じzlibストリーム)
+class fdAT : public BaseChunkData{
+private:
+  uint32_t sequence_number_ = 0;
+  std::vector<uint8_t> frame_data_;
+public:
+  fdAT() = default;
+  fdAT(const uint32_t length, const std::vector<char>& data){
+    set(length, data);
+  }
+  void set(const uint32_t length, const std::vector<char>& data) override{
+    assert(length >= 4);
+    length_ = length;
+    data_raw_ = data;
+    sequence_number_ = utils::vecchar2int(data.data());
+    frame_data_.assign(data.begin() + 4, data.end());
+  }
+  inline std::vector<char> get() const override{
+    std::vector<char> res = utils::int2vecchar(sequence_number_);
+    res.insert(res.end(), frame_data_.begin(), frame_data_.end());
+    return res;
+  }
+  void clear() override{
+    BaseChunkData::clear();
+    sequence_number_ = 0;
+    frame_data_.clear();
+  }
+  void debug() const override{
+    std::cout << std::format("\tsequence_number: {:08X}", sequence_number_) << std::endl;
+  }
+  // ゲッター
+  uint32_t& sequence_number() { return sequence_number_; }
+  const uint32_t& sequence_number() const { return sequence_number_; }
+  std::vector<uint8_t>& frame_data() { return frame_data_; }
+  const std::vector<uint8_t>& frame_data() const { return frame_data_; }
+};
+
+// 解釈しないチャンク(gAMA, pHYs, iCCPなど): 生データをそのまま書き戻す
+class Unknown : public BaseChunkData{
+public:
+  Unknown() = default;
+  Unknown(const uint32_t length, const std::vector<char>& data){
+    set(length, data);
+  }
+  void set(const uint32_t length, const std::vector<char>& data) override{
+    length_ = length;
+    data_raw_ = data;
+  }
+  inline std::vector<char> get() const override{
+    return data_raw_;
+  }
+  void clear() override{
+    BaseChunkData::clear();
+  }
+  void debug() const override {}
+};
+
+using ChunkData = std::variant<Unknown, IHDR, PLTE, sRGB, tEXT, IDAT, IEND, pIdX, acTL, fcTL, fdAT>;
 
 // チャンククラス
 class Chunk{
@@ -386,12 +672,21 @@ public:
     std::copy_n(ptr + BYTE_LENGTH + BYTE_TYPE, data_size, data_raw_.begin());
 
     // チャンクタイプに応じてデータを設定
-    if(utils::equal_stri(type_string_, "IHDR"))      data_ = IHDR{length_, data_raw_};
-    else if(utils::equal_stri(type_string_, "PLTE")) data_ = PLTE{length_, data_raw_};
-    else if(utils::equal_stri(type_string_, "sRGB")) data_ = sRGB{length_, data_raw_};
-    else if(utils::equal_stri(type_string_, "tEXT")) data_ = tEXT{length_, data_raw_};
-    else if(utils::equal_stri(type_string_, "IDAT")) data_ = IDAT{length_, data_raw_};
-    else if(utils::equal_stri(type_string_, "IEND")) data_ = IEND{length_, data_raw_};
+    switch(type_){
+      case TYPE_IHDR: data_ = IHDR{length_, data_raw_}; break;
+      case TYPE_PLTE: data_ = PLTE{length_, data_raw_}; break;
+      case TYPE_sRGB: data_ = sRGB{length_, data_raw_}; break;
+      case TYPE_tEXt:
+      case TYPE_tEXT: data_ = tEXT{length_, data_raw_}; break;
+      case TYPE_IDAT: data_ = IDAT{length_, data_raw_}; break;
+      case TYPE_IEND: data_ = IEND{length_, data_raw_}; break;
+      case TYPE_pIdX:
+      case TYPE_pIDX: data_ = pIdX{length_, data_raw_}; break;
+      case TYPE_acTL: data_ = acTL{length_, data_raw_}; break;
+      case TYPE_fcTL: data_ = fcTL{length_, data_raw_}; break;
+      case TYPE_fdAT: data_ = fdAT{length_, data_raw_}; break;
+      default:        data_ = Unknown{length_, data_raw_}; break;
+    }
 
     // CRCチェック
     crc_ = (static_cast<uint8_t>(ptr[BYTE_LENGTH + BYTE_TYPE + length_]) << 24) |
@@ -0,0 +1,290 @@
+# pragma once
+# include "chunk.hpp"
+# include <array>
+# include <cstring>
+# include <cmath>
+# if defined(__SSSE3__)
+#   include <immintrin.h>
+# endif
+
+namespace png {
+namespace utils{
+  // パレットと各ピクセルのパレット番号
+  struct IndexedImage{
+    std::vector<std::array<uint8_t, 3>> palette;
+    std::vector<uint8_t> indices; // width*height個
+  };
+
+  // パレットの色数からビット深度を決める
+  inline uint8_t palette_bit_depth(const size_t num_colors) noexcept {
+    if(num_colors <= 2) return 1;
+    if(num_colors <= 4) return 2;
+    if(num_colors <= 16) return 4;
+    return 8;
+  }
+
+  // 色数がmax_colors以下なら、その色だけのパレットを作る。超えた時点でfalseを返す
+  // 画像の行は先頭にフィルタタイプ用の1バイトがある配置(width*3+1バイト)
+  inline bool exact_palette(const uint8_t* image, const size_t width, const size_t height, const size_t max_colors, IndexedImage& res){
+    // 開番地法のハッシュ表(キーは色|0x1000000で、0は空き)
+    constexpr size_t TABLE_SIZE = 1024;
+    std::array<uint32_t, TABLE_SIZE> keys{};
+    std::array<uint8_t, TABLE_SIZE> values{};
+    res.palette.clear();
+    res.indices.resize(width * height);
+    const size_t width_data = width * 3 + 1;
+    uint32_t last_key = 0;
+    uint8_t last_index = 0;
+    for(size_t y = 0; y < height; y++){
+      const uint8_t* row = image + y * width_data + 1;
+      uint8_t* out = res.indices.data() + y * width;
+      for(size_t x = 0; x < width; x++){
+        const uint32_t key = 0x1000000 | (row[x*3] << 16) | (row[x*3+1] << 8) | row[x*3+2];
+        // 同じ色が続くことが多いので直前の色を先に確認
+        if(key == last_key){
+          out[x] = last_index;
+          continue;
+        }
+        size_t slot = (key * UINT32_C(0x9E3779B1)) >> 22;
+        while(keys[slot] != 0 && keys[slot] != key) slot = (slot + 1) & (TABLE_SIZE - 1);
+        if(keys[slot] == 0){
+          if(res.palette.size() == max_colors) return false;
+          keys[slot] = key;
+          values[slot] = static_cast<uint8_t>(res.palette.size());
+          res.palette.push_back({row[x*3], row[x*3+1], row[x*3+2]});
+        }
+        last_key = key;
+        last_index = values[slot];
+        out[x] = last_index;
+      }
+    }
+    return true;
+  }
+
+  // 各チャネル5ビットのヒストグラムをメディアンカットで分割し、k-meansで整えてmax_colors色に減色する
+  inline IndexedImage quantize_palette(const uint8_t* image, const size_t width, const size_t height, const size_t max_colors){
+    constexpr size_t NUM_BINS = 1 << 15;
+    const auto bin_of = [](const uint8_t* p){
+      return ((p[0] >> 3) << 10) | ((p[1] >> 3) << 5) | (p[2] >> 3);
+    };
+    const size_t width_data = width * 3 + 1;
+    // 大きな画像は約100万画素になるよう間引いてヒストグラムを取る
+    const size_t num_pixels = width * height;
+    const size_t step = std::max<size_t>(1, num_pixels >> 20);
+    std::vector<uint32_t> counts(NUM_BINS, 0);
+    std::vector<std::array<uint64_t, 3>> sums(NUM_BINS, std::array<uint64_t, 3>{});
+    for(size_t i = 0; i < num_pixels; i += step){
+      const uint8_t* p = image + (i / width) * width_data + 1 + (i % width) * 3;
+      const size_t bin = bin_of(p);
+      counts[bin]++;
+      sums[bin][0] += p[0];
+      sums[bin][1] += p[1];
+      sums[bin][2] += p[2];
+    }
+    // 空でないビンの平均色と重み
+    struct Bin{
+      std::array<double, 3> color;
+      uint32_t count;
+    };
+    std::vector<Bin> bins;
+    for(size_t i = 0; i < NUM_BINS; i++){
+      if(counts[i] == 0) continue;
+      bins.push_back({{
+        static_cast<double>(sums[i][0]) / counts[i],
+        static_cast<double>(sums[i][1]) / counts[i],
+        static_cast<double>(sums[i][2]) / counts[i]
+      }, counts[i]});
+    }
+    // メディアンカット: 画素数×色の幅が最大の箱を、幅が最大のチャネルの重み付き中央値で分ける
+    struct Box{
+      size_t begin, end; // binsの範囲
+    };
+    std::vector<Box> boxes{{0, bins.size()}};
+    const auto box_extent = [&](const Box& box, int& channel){
+      double best = -1.0;
+      for(int c = 0; c < 3; c++){
+        double lo = 255.0, hi = 0.0;
+        for(size_t i = box.begin; i < box.end; i++){
+          lo = std::min(lo, bins[i].color[c]);
+          hi = std::max(hi, bins[i].color[c]);
+        }
+        if(hi - lo > best){
+          best = hi - lo;
+          channel = c;
+        }
+      }
+      uint64_t weight = 0;
+      for(size_t i = box.begin; i < box.end; i++) weight += bins[i].count;
+      return best * static_cast<double>(weight);
+    };
+    while(boxes.size() < max_colors){
+      size_t target = boxes.size();
+      int channel = 0;
+      double best = 0.0;
+      for(size_t b = 0; b < boxes.size(); b++){
+        if(boxes[b].end - boxes[b].begin < 2) continue;
+        int c = 0;
+        const double extent = box_extent(boxes[b], c);
+        if(extent > best){
+          best = extent;
+          target = b;
+          channel = c;
+        }
+      }
+      if(target == boxes.size()) break;
+      Box& box = boxes[target];
+      std::sort(bins.begin() + box.begin, bins.begin() + box.end, [&](const Bin& a, const Bin& b){
+        return a.color[channel] < b.color[channel];
+      });
+      uint64_t total = 0;
+      for(size_t i = box.begin; i < box.end; i++) total += bins[i].count;
+      uint64_t acc = 0;
+      size_t split = box.begin + 1;
+      for(size_t i = box.begin; i < box.end - 1; i++){
+        acc += bins[i].count;
+        split = i + 1;
+        if(acc * 2 >= total) break;
+      }
+      const Box upper{split, box.end};
+      box.end = split;
+      boxes.push_back(upper);
+    }
+    std::vector<std::array<double, 3>> centers(boxes.size());
+    for(size_t b = 0; b < boxes.size(); b++){
+      std::array<double, 3> sum{};
+      double weight = 0.0;
+      for(size_t i = boxes[b].begin; i < boxes[b].end; i++){
+        for(int c = 0; c < 3; c++) sum[c] += bins[i].color[c] * bins[i].count;
+        weight += bins[i].count;
+      }
+      for(int c = 0; c < 3; c++) centers[b][c] = sum[c] / weight;
+    }
+    const auto nearest = [&](const std::array<double, 3>& color){
+      size_t best = 0;
+      double best_distance = 1e30;
+      for(size_t k = 0; k < centers.size(); k++){
+        const double dr = color[0] - centers[k][0];
+        const double dg = color[1] - centers[k][1];
+        const double db = color[2] - centers[k][2];
+        const double distance = dr * dr + dg * dg + db * db;
+        if(distance < best_distance){
+          best_distance = distance;
+          best = k;
+        }
+      }
+      return best;
+    };
+    // ビンの平均色を点としてk-meansを数回
+    for(int iteration = 0; iteration < 4; iteration++){
+      std::vector<std::array<double, 3>> sum(centers.size(), std::array<double, 3>{});
+      std::vector<double> weight(centers.size(), 0.0);
+      for(const Bin& bin : bins){
+        const size_t k = nearest(bin.color);
+        for(int c = 0; c < 3; c++) sum[k][c] += bin.color[c] * bin.count;
+        weight[k] += bin.count;
+      }
+      for(size_t k = 0; k < centers.size(); k++){
+        if(weight[k] == 0.0) continue;
+        for(int c = 0; c < 3; c++) centers[k][c] = sum[k][c] / weight[k];
+      }
+    }
+    IndexedImage res;
+    res.palette.resize(centers.size());
+    for(size_t k = 0; k < centers.size(); k++){
+      for(int c = 0; c < 3; c++){
+        res.palette[k][c] = static_cast<uint8_t>(std::clamp(std::lround(centers[k][c]), 0L, 255L));
+      }
+    }
+    // ビンごとの最近傍パレット番号を表にしてから全画素を引く(間引いたときに現れなかったビンはその場で求める)
+    std::vector<int16_t> lookup(NUM_BINS, -1);
+    res.indices.resize(num_pixels);
+    for(size_t y = 0; y < height; y++){
+      const uint8_t* row = image + y * width_data + 1;
+      uint8_t* out = res.indices.data() + y * width;
+      for(size_t x = 0; x < width; x++){
+        const size_t bin = bin_of(row + x * 3);
+        if(lookup[bin] < 0){
+          const std::array<double, 3> color{
+            static_cast<double>(((bin >> 10) & 31) << 3 | 4),
+            static_cast<double>(((bin >> 5) & 31) << 3 | 4),
+            static_cast<double>((bin & 31) << 3 | 4)
+          };
+          lookup[bin] = static_cast<int16_t>(counts[bin] != 0 ? nearest({
+            static_cast<double>(sums[bin][0]) / counts[bin],
+            static_cast<double>(sums[bin][1]) / counts[bin],
+            static_cast<double>(sums[bin][2]) / counts[bin]
+          }) : nearest(color));
+        }
+        out[x] = static_cast<uint8_t>(lookup[bin]);
+      }
+    }
+    return res;
+  }
+
+  // パレット番号の並びをbit_depthビットずつ上位ビットから詰める
+  inline void pack_indices(const uint8_t* indices, uint8_t* out, const size_t width, const uint8_t bit_depth) noexcept {
+    if(bit_depth == 8){
+      std::memcpy(out, indices, width);
+      return;
+    }
+    const size_t per_byte = 8 / bit_depth;
+    size_t x = 0;
+# if defined(__SSSE3__)
+    // 16画素ずつまとめて詰める
+    if(bit_depth == 4){
+      // 隣り合う2画素を a*16+b にする
+      const __m128i weights = _mm_set1_epi16(0x0110);
+      for(; x + 16 <= width; x += 16){
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(indices + x));
+        const __m128i pairs = _mm_maddubs_epi16(v, weights);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(out + x / 2), _mm_packus_epi16(pairs, pairs));
+      }
+    }else if(bit_depth == 2){
+      // 2画素を a*4+b に、さらに2組を (a*4+b)*16+(c*4+d) にする
+      const __m128i weights_pair = _mm_set1_epi16(0x0104);
+      const __m128i weights_quad = _mm_set1_epi32(0x00010010);
+      for(; x + 16 <= width; x += 16){
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(indices + x));
+        const __m128i quads = _mm_madd_epi16(_mm_maddubs_epi16(v, weights_pair), weights_quad);
+        const __m128i packed16 = _mm_packs_epi32(quads, quads);
+        const __m128i packed8 = _mm_packus_epi16(packed16, packed16);
+        const uint32_t bytes = static_cast<uint32_t>(_mm_cvtsi128_si32(packed8));
+        std::memcpy(out + x / 4, &bytes, 4);
+      }
+    }else if(bit_depth == 1){
+      // 8画素ごとに並びを逆にして最下位ビットを最上位へ移し、movemaskで取り出す
+      const __m128i reverse = _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+      for(; x + 16 <= width; x += 16){
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(indices + x));
+        const __m128i bits = _mm_slli_epi16(_mm_shuffle_epi8(v, reverse), 7);
+        const uint16_t mask = static_cast<uint16_t>(_mm_movemask_epi8(bits));
+        out[x / 8] = static_cast<uint8_t>(mask & 0xFF);
+        out[x / 8 + 1] = static_cast<uint8_t>(mask >> 8);
+      }
+    }
+# endif
+    for(; x < width; x += per_byte){
+      uint8_t byte = 0;
+      for(size_t i = 0; i < per_byte; i++){
+        const uint8_t index = (x + i < width) ? indices[x + i] : 0;
+        byte |= index << (8 - bit_depth * (i + 1));
+      }
+      out[x / per_byte] = byte;
+    }
+  }
+
+  // 上位ビットから詰められたbit_depthビットのパレット番号をwidth個取り出す
+  inline void unpack_indices(const uint8_t* packed, uint8_t* indices, const size_t width, const uint8_t bit_depth) noexcept {
+    if(bit_depth == 8){
+      std::memcpy(indices, packed, width);
+      return;
+    }
+    const size_t per_byte = 8 / bit_depth;
+    const uint8_t mask = static_cast<uint8_t>((1 << bit_depth) - 1);
+    for(size_t x = 0; x < width; x++){
+      const size_t shift = 8 - bit_depth * (x % per_byte + 1);
+      indices[x] = (packed[x / per_byte] >> shift) & mask;
+    }
+  }
+}
+} // namespace png
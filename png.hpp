@@ -1,10 +1,19 @@
 # pragma once
 # include "chunk.hpp"
+# include "palette.hpp"
 # include <random>
-
-std::random_device seed_gen;
-std::default_random_engine engine(seed_gen());
-
+# include <thread>
+# include <atomic>
+# include <mutex>
+# include <exception>
+# include <cstring>
+# include <cmath>
+# include <array>
+# include <memory>
+# include <chrono>
+# if defined(__SSSE3__)
+#   include <immintrin.h>
+# endif
 
 template<typename T, typename U>
 std::ostream& operator<<(std::ostream& os, const std::pair<T, U>& p){
@@ -12,12 +21,707 @@ std::ostream& operator<<(std::ostream& os, const std::pair<T, U>& p){
   return os;
 }
 
-inline int rand_int(int min, int max){
-  std::uniform_int_distribution<> dist(min, max);
-  return dist(engine);
-} 
-
 namespace png {
+namespace utils{
+  // parallel_forの作業スレッドの中かどうか(入れ子の呼び出しはスレッドを増やさずその場で順に実行)
+  inline thread_local bool in_parallel_worker = false;
+  // [0, n)の各インデックスについてfをスレッドで並列実行
+  template<typename F>
+  void parallel_for(const size_t n, F&& f){
+    const size_t num_threads = in_parallel_worker ? 1 : std::min<size_t>(n, std::max(1u, std::thread::hardware_concurrency()));
+    if(num_threads <= 1){
+      for(size_t i = 0; i < n; i++) f(i);
+      return;
+    }
+    std::atomic<size_t> next{0};
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    std::vector<std::thread> workers;
+    workers.reserve(num_threads);
+    for(size_t t = 0; t < num_threads; t++){
+      workers.emplace_back([&](){
+        in_parallel_worker = true;
+        for(size_t i = next++; i < n; i = next++){
+          try{
+            f(i);
+          }catch(...){
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if(!error) error = std::current_exception();
+          }
+        }
+      });
+    }
+    for(std::thread& worker : workers) worker.join();
+    if(error) std::rethrow_exception(error);
+  }
+  // [0, n)をband件ずつの区間に分け、各区間(begin, end)についてfを並列実行
+  template<typename F>
+  void parallel_for_bands(const size_t n, const size_t band, F&& f){
+    parallel_for((n + band - 1) / band, [&](const size_t i){
+      f(i * band, std::min(n, (i + 1) * band));
+    });
+  }
+  // 1行(先頭はフィルタタイプ)のフィルタを外してoutに書き込む。prevは復元済みの上の行(なければnullptr)
+  // filteredとoutは同じ領域でもよい。BPPは左隣の画素までのバイト数
+  template<size_t BPP = 3>
+  inline void unfilter_row(const uint8_t* filtered, const uint8_t* prev, uint8_t* out, const size_t width_data) noexcept {
+    const uint8_t filter_type = filtered[0];
+    const bool has_prev_row = prev != nullptr;
+    // フィルタタイプに応じた処理
+    switch(filter_type){
+      case 1:{ // Subフィルタ
+        for(size_t x = 1; x < width_data; x++){
+          const uint8_t left = (x > BPP) ? out[x-BPP] : 0;
+          out[x] = (filtered[x] + left) & 0xFF;
+        }
+        break;
+      }
+      case 2:{ // Upフィルタ
+        if(has_prev_row){
+          for(size_t x = 1; x < width_data; x++){
+            out[x] = (filtered[x] + prev[x]) & 0xFF;
+          }
+        }else{
+          for(size_t x = 1; x < width_data; x++){
+            out[x] = filtered[x];
+          }
+        }
+        break;
+      }
+      case 3:{ // Averageフィルタ
+        for(size_t x = 1; x < width_data; x++){
+          const uint8_t left = (x > BPP) ? out[x-BPP] : 0;
+          const uint8_t up = has_prev_row ? prev[x] : 0;
+          out[x] = (filtered[x] + ((left + up) >> 1)) & 0xFF;
+        }
+        break;
+      }
+      case 4:{ // Paethフィルタ
+        for(size_t x = 1; x < width_data; x++){
+          const uint8_t left = (x > BPP) ? out[x-BPP] : 0;
+          const uint8_t up = has_prev_row ? prev[x] : 0;
+          const uint8_t upleft = (x > BPP && has_prev_row) ? prev[x-BPP] : 0;
+          const int p = left + up - upleft;
+          const int pa = std::abs(p - left);
+          const int pb = std::abs(p - up);
+          const int pc = std::abs(p - upleft);
+          const uint8_t predictor = (pa <= pb && pa <= pc) ? left : (pb <= pc ? up : upleft);
+          out[x] = (filtered[x] + predictor) & 0xFF;
+        }
+        break;
+      }
+      default:{
+        for(size_t x = 1; x < width_data; x++){
+          out[x] = filtered[x];
+        }
+      }
+    }
+  }
+  // 1行(先頭はフィルタタイプ)にfilter_typeのフィルタをかけてoutに書き込む。prevは上の行(なければnullptr)
+  inline void filter_row_as(const uint8_t filter_type, const uint8_t* cur, const uint8_t* prev, uint8_t* out, const size_t width_data) noexcept {
+    const bool has_prev_row = prev != nullptr;
+    out[0] = filter_type;
+    switch(filter_type){
+      case 0: // Noneフィルタ
+        for(size_t x = 1; x < width_data; x++){
+          out[x] = cur[x];
+        }
+        break;
+      case 1: // Subフィルタ
+        for(size_t x = 1; x < width_data; x++){
+          const uint8_t left = (x >= 4) ? cur[x - 3] : 0;
+          out[x] = (cur[x] - left) & 0xFF;
+        }
+        break;
+      case 2: // Upフィルタ
+        for(size_t x = 1; x < width_data; x++){
+          const uint8_t up = has_prev_row ? prev[x] : 0;
+          out[x] = (cur[x] - up) & 0xFF;
+        }
+        break;
+      case 3: // Averageフィルタ
+        for(size_t x = 1; x < width_data; x++){
+          const uint8_t left = (x >= 4) ? cur[x - 3] : 0;
+          const uint8_t up = has_prev_row ? prev[x] : 0;
+          out[x] = (cur[x] - ((left + up) >> 1)) & 0xFF;
+        }
+        break;
+      case 4: // Paethフィルタ
+        for(size_t x = 1; x < width_data; x++){
+          const uint8_t left = (x >= 4) ? cur[x - 3] : 0;
+          const uint8_t up = has_prev_row ? prev[x] : 0;
+          const uint8_t upleft = (x >= 4 && has_prev_row) ? prev[x - 3] : 0;
+          const int p = left + up - upleft;
+          const int pa = std::abs(p - left);
+          const int pb = std::abs(p - up);
+          const int pc = std::abs(p - upleft);
+          const uint8_t predictor = (pa <= pb && pa <= pc) ? left : (pb <= pc ? up : upleft);
+          out[x] = (cur[x] - predictor) & 0xFF;
+        }
+        break;
+    }
+  }
+  // 1行(先頭はフィルタタイプ)に対して先頭num_filters種のフィルタを試し、スコアが最小のものをoutに書き込む
+  // スコアはバイト値の和(signed_scoreなら符号付きとみなした絶対値の和)
+  // prevは上の行(なければnullptr)、filtered_resultsは5行分の作業領域
+  inline void filter_row(const uint8_t* cur, const uint8_t* prev, uint8_t* out, const size_t width_data,
+                         const uint8_t num_filters, std::vector<std::vector<uint8_t>>& filtered_results,
+                         const bool signed_score = false){
+    std::array<size_t, 5> row_filter_scores{};
+    // フィルタ結果配列を初期化
+    for(uint8_t filter_type = 0; filter_type < 5; filter_type++){
+      filtered_results[filter_type].resize(width_data);
+    }
+    // num_filters種のフィルタについてそれぞれ試す
+    for(uint8_t filter_type = 0; filter_type < num_filters; filter_type++){
+      filter_row_as(filter_type, cur, prev, filtered_results[filter_type].data(), width_data);
+      // この行のフィルタスコアを計算
+      for(size_t x = 1; x < width_data; x++){
+        const uint8_t v = filtered_results[filter_type][x];
+        row_filter_scores[filter_type] += signed_score ? std::abs(static_cast<int8_t>(v)) : v;
+      }
+    }
+    // この行で最もスコアの低い（圧縮に適した）フィルタを選択
+    size_t best_filter = 0;
+    size_t best_score = row_filter_scores[0];
+    for(size_t i = 1; i < num_filters; i++){
+      if(row_filter_scores[i] < best_score){
+        best_score = row_filter_scores[i];
+        best_filter = i;
+      }
+    }
+    // 最適なフィルタの結果を最終的な出力にコピー
+    std::copy(filtered_results[best_filter].begin(), filtered_results[best_filter].end(), out);
+  }
+  // 画像全体でのフィルタの選び方
+  enum class FilterStrategy : uint8_t{
+    NONE, SUB, UP, AVERAGE, PAETH, // 全行で同じフィルタ
+    ADAPTIVE, // 行ごとにバイト値の和が最小のもの
+    ADAPTIVE_SIGNED // 行ごとに符号付きとみなした絶対値の和が最小のもの
+  };
+  // フィルターなしの画像imageの[y_begin, y_end)行をstrategyでフィルタし、outの先頭から詰めて書き込む
+  // segment_rowsが0でなければ、その行数ごとの区間の先頭行は上の行を参照しないNone/Subのみ
+  inline void filter_rows(const uint8_t* image, uint8_t* out, const size_t width_data, const size_t y_begin, const size_t y_end,
+                          const FilterStrategy strategy, const uint32_t segment_rows){
+    std::vector<std::vector<uint8_t>> filtered_results(5);
+    for(size_t y = y_begin; y < y_end; y++){
+      const uint8_t* cur = image + y * width_data;
+      const uint8_t* prev = y > 0 ? cur - width_data : nullptr;
+      uint8_t* dst = out + (y - y_begin) * width_data;
+      const bool segment_start = segment_rows != 0 && y % segment_rows == 0;
+      switch(strategy){
+        case FilterStrategy::ADAPTIVE:
+        case FilterStrategy::ADAPTIVE_SIGNED:
+          utils::filter_row(
+            cur, prev, dst, width_data, segment_start ? 2 : 5, filtered_results,
+            strategy == FilterStrategy::ADAPTIVE_SIGNED
+          );
+          break;
+        default:{
+          const uint8_t filter_type = static_cast<uint8_t>(strategy);
+          filter_row_as(segment_start ? std::min<uint8_t>(filter_type, 1) : filter_type, cur, prev, dst, width_data);
+          break;
+        }
+      }
+    }
+  }
+  // deflateの設定(既定値はdeflateInitと同じ)
+  struct DeflateParams{
+    int level = Z_DEFAULT_COMPRESSION;
+    int window_bits = 15;
+    int mem_level = 8;
+    int strategy = Z_DEFAULT_STRATEGY;
+  };
+  // width_dataバイトの行height行からなるdataをzlib形式で圧縮してoutに書き込む
+  // segment_rowsが0でなければその行数ごとに全フラッシュし、各区間の(開始行, オフセット)をentriesに記録
+  inline void deflate_rows(const uint8_t* data, const size_t width_data, const size_t height, const DeflateParams& params,
+                           const uint32_t segment_rows, std::vector<uint8_t>& out,
+                           std::vector<std::pair<uint32_t, uint32_t>>* entries = nullptr){
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    if(deflateInit2(&strm, params.level, Z_DEFLATED, params.window_bits, params.mem_level, params.strategy) != Z_OK){
+      throw std::runtime_error("deflateInit failed");
+    }
+    if(entries) entries->clear();
+    const size_t segment = segment_rows != 0 ? segment_rows : std::max<size_t>(height, 1);
+    const size_t num_segments = (height + segment - 1) / segment;
+    out.resize(deflateBound(&strm, width_data * height) + num_segments * 16);
+    strm.avail_out = out.size();
+    strm.next_out = out.data();
+    uint32_t offset = 2; // zlibヘッダの直後
+    for(size_t row = 0; row < height || row == 0; row += segment){
+      const size_t row_end = std::min(row + segment, height);
+      const int flush = (row_end == height) ? Z_FINISH : Z_FULL_FLUSH;
+      strm.avail_in = (row_end - row) * width_data;
+      strm.next_in = const_cast<Bytef*>(data + row * width_data);
+      int ret;
+      do{
+        // 出力バッファが尽きたら拡張して続行
+        if(strm.avail_out == 0){
+          out.resize(out.size() * 2);
+          strm.avail_out = out.size() - strm.total_out;
+          strm.next_out = out.data() + strm.total_out;
+        }
+        ret = deflate(&strm, flush);
+      }while(ret != Z_STREAM_ERROR && strm.avail_out == 0);
+      if(ret != (flush == Z_FINISH ? Z_STREAM_END : Z_OK)){
+        deflateEnd(&strm);
+        throw std::runtime_error("deflate failed");
+      }
+      if(entries) entries->push_back({static_cast<uint32_t>(row), offset});
+      offset = strm.total_out;
+    }
+    out.resize(strm.total_out);
+    deflateEnd(&strm);
+  }
+  // compressedを解凍した結果がexpectedと一致するか
+  inline bool inflate_equals(const std::vector<uint8_t>& compressed, const std::vector<uint8_t>& expected){
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = compressed.size();
+    strm.next_in = const_cast<Bytef*>(compressed.data());
+    if(inflateInit(&strm) != Z_OK) return false;
+    std::vector<uint8_t> buffer(expected.size() + 1);
+    strm.avail_out = buffer.size();
+    strm.next_out = buffer.data();
+    const int ret = inflate(&strm, Z_FINISH);
+    const bool equal = ret == Z_STREAM_END && strm.total_out == expected.size()
+                       && std::memcmp(buffer.data(), expected.data(), expected.size()) == 0;
+    inflateEnd(&strm);
+    return equal;
+  }
+
+  // 実数カーネルを総和を保ったままQ14固定小数点に変換
+  inline std::vector<int32_t> quantize_kernel(const std::vector<double>& kernel){
+    if(kernel.empty() || kernel.size() % 2 == 0){
+      throw std::runtime_error("Kernel length must be odd");
+    }
+    std::vector<int32_t> res(kernel.size());
+    double sum = 0.0;
+    int32_t sum_fixed = 0;
+    for(size_t i = 0; i < kernel.size(); i++){
+      res[i] = static_cast<int32_t>(std::lround(kernel[i] * (1 << 14)));
+      sum += kernel[i];
+      sum_fixed += res[i];
+    }
+    // 丸め誤差は中央の重みで吸収
+    res[kernel.size() / 2] += static_cast<int32_t>(std::lround(sum * (1 << 14))) - sum_fixed;
+    return res;
+  }
+  // 3回の箱型ぼかしで標準偏差sigmaのガウスぼかしを近似する各半径
+  inline std::vector<uint32_t> gaussian_box_radii(const double sigma){
+    constexpr int n = 3;
+    const double width_ideal = std::sqrt(12.0 * sigma * sigma / n + 1.0);
+    int width_lower = static_cast<int>(std::floor(width_ideal));
+    if(width_lower % 2 == 0) width_lower--;
+    const int width_upper = width_lower + 2;
+    const double m_ideal = (12.0 * sigma * sigma - n * width_lower * width_lower - 4.0 * n * width_lower - 3.0 * n) / (-4.0 * width_lower - 4.0);
+    const int m = static_cast<int>(std::lround(m_ideal));
+    std::vector<uint32_t> res(n);
+    for(int i = 0; i < n; i++){
+      res[i] = ((i < m ? width_lower : width_upper) - 1) / 2;
+    }
+    return res;
+  }
+  // 面積平均でsrc(src_height×src_width)をscale倍にリサンプリングし、出力の[y_begin, y_end)行をdst(y_begin行目が先頭)に書き込む
+  inline void resample_area_rows(const uint8_t* src, const uint32_t src_height, const uint32_t src_width,
+                                 const double scale_height, const double scale_width, const uint32_t width_resized,
+                                 const uint32_t y_begin, const uint32_t y_end, uint8_t* dst) noexcept {
+    const size_t row_size = static_cast<size_t>(width_resized) * 3 + 1;
+    // 出力画像の各ピクセルに対して処理
+    for(uint32_t y = y_begin; y < y_end; y++) {
+      // フィルタタイプを設定（0: None）
+      dst[(y - y_begin) * row_size] = 0;
+      for(uint32_t x = 0; x < width_resized; x++) {
+        // 元画像での対応する座標範囲を計算
+        double src_x_start = x / scale_width;
+        double src_y_start = y / scale_height;
+        double src_x_end = (x + 1) / scale_width;
+        double src_y_end = (y + 1) / scale_height;
+        // 元画像のピクセル範囲を取得
+        uint32_t src_x0 = static_cast<uint32_t>(src_x_start);
+        uint32_t src_y0 = static_cast<uint32_t>(src_y_start);
+        uint32_t src_x1 = std::min(static_cast<uint32_t>(src_x_end) + 1, src_width);
+        uint32_t src_y1 = std::min(static_cast<uint32_t>(src_y_end) + 1, src_height);
+        // RGB各チャンネルに対して重み付け平均を計算
+        for(int c = 0; c < 3; c++) {
+          double weighted_sum = 0.0;
+          double total_weight = 0.0;
+          // 重なっている元画像のピクセルを処理
+          for(uint32_t src_y = src_y0; src_y < src_y1; src_y++) {
+            for(uint32_t src_x = src_x0; src_x < src_x1; src_x++) {
+              // 重なりの面積を計算
+              double overlap_x_start = std::max(src_x_start, static_cast<double>(src_x));
+              double overlap_x_end = std::min(src_x_end, static_cast<double>(src_x + 1));
+              double overlap_y_start = std::max(src_y_start, static_cast<double>(src_y));
+              double overlap_y_end = std::min(src_y_end, static_cast<double>(src_y + 1));
+              double overlap_area = (overlap_x_end - overlap_x_start) * (overlap_y_end - overlap_y_start);
+              // 元画像のピクセル値を取得（フィルタなしのデータから）
+              size_t src_idx = src_y * (static_cast<size_t>(src_width) * 3 + 1) + src_x * 3 + c + 1;
+              uint8_t src_value = src[src_idx];
+              weighted_sum += src_value * overlap_area;
+              total_weight += overlap_area;
+            }
+          }
+          // 重み付け平均を計算して出力
+          size_t dst_idx = (y - y_begin) * row_size + x * 3 + c + 1;
+          dst[dst_idx] = static_cast<uint8_t>(weighted_sum / total_weight);
+        }
+      }
+    }
+  }
+  // 面積平均でsrc(src_height×src_width)を(height_resized×width_resized)にリサンプリング
+  inline std::vector<uint8_t> resample_area(const std::vector<uint8_t>& src, const uint32_t src_height, const uint32_t src_width,
+                                            const double scale_height, const double scale_width,
+                                            const uint32_t height_resized, const uint32_t width_resized){
+    std::vector<uint8_t> image_data_resized(height_resized * (static_cast<size_t>(width_resized) * 3 + 1));
+    resample_area_rows(
+      src.data(), src_height, src_width, scale_height, scale_width, width_resized, 0, height_resized, image_data_resized.data()
+    );
+    return image_data_resized;
+  }
+  // 2×2画素の平均で縦横半分に縮小(奇数のときは最後の行・列を捨てる)
+  inline void reduce_half(const uint8_t* src, const size_t src_width_data, uint8_t* dst, const size_t dst_width_data,
+                          const size_t height, const size_t width) noexcept {
+    for(size_t y = 0; y < height; y++){
+      const uint8_t* row0 = src + y * 2 * src_width_data + 1;
+      const uint8_t* row1 = row0 + src_width_data;
+      uint8_t* out = dst + y * dst_width_data + 1;
+      size_t x = 0;
+# if defined(__SSSE3__)
+      // 8ピクセル(24バイト)を偶数番目と奇数番目の4ピクセルに振り分け、16ビットで4画素を足して4出力ピクセルを得る。
+      // 書き込みの末尾4バイトは次の反復で上書きされるので、後ろに2ピクセル以上残っている間だけ使う
+      const __m128i even_lo = _mm_setr_epi8(0, 1, 2, 6, 7, 8, 12, 13, 14, -1, -1, -1, -1, -1, -1, -1);
+      const __m128i even_hi = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, 10, 11, 12, -1, -1, -1, -1);
+      const __m128i odd_lo = _mm_setr_epi8(3, 4, 5, 9, 10, 11, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+      const __m128i odd_hi = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, 8, 9, 13, 14, 15, -1, -1, -1, -1);
+      const __m128i zero = _mm_setzero_si128();
+      const __m128i two = _mm_set1_epi16(2);
+      for(; x + 6 <= width; x += 4){
+        const __m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row0 + x * 6));
+        const __m128i a1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row0 + x * 6 + 8));
+        const __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row1 + x * 6));
+        const __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row1 + x * 6 + 8));
+        const __m128i a_even = _mm_or_si128(_mm_shuffle_epi8(a0, even_lo), _mm_shuffle_epi8(a1, even_hi));
+        const __m128i a_odd = _mm_or_si128(_mm_shuffle_epi8(a0, odd_lo), _mm_shuffle_epi8(a1, odd_hi));
+        const __m128i b_even = _mm_or_si128(_mm_shuffle_epi8(b0, even_lo), _mm_shuffle_epi8(b1, even_hi));
+        const __m128i b_odd = _mm_or_si128(_mm_shuffle_epi8(b0, odd_lo), _mm_shuffle_epi8(b1, odd_hi));
+        const __m128i sum_lo = _mm_add_epi16(
+          _mm_add_epi16(_mm_unpacklo_epi8(a_even, zero), _mm_unpacklo_epi8(a_odd, zero)),
+          _mm_add_epi16(_mm_unpacklo_epi8(b_even, zero), _mm_unpacklo_epi8(b_odd, zero))
+        );
+        const __m128i sum_hi = _mm_add_epi16(
+          _mm_add_epi16(_mm_unpackhi_epi8(a_even, zero), _mm_unpackhi_epi8(a_odd, zero)),
+          _mm_add_epi16(_mm_unpackhi_epi8(b_even, zero), _mm_unpackhi_epi8(b_odd, zero))
+        );
+        const __m128i avg = _mm_packus_epi16(
+          _mm_srli_epi16(_mm_add_epi16(sum_lo, two), 2),
+          _mm_srli_epi16(_mm_add_epi16(sum_hi, two), 2)
+        );
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x * 3), avg);
+      }
+# endif
+      for(; x < width; x++){
+        for(size_t c = 0; c < 3; c++){
+          out[x * 3 + c] = static_cast<uint8_t>(
+            (row0[x * 6 + c] + row0[x * 6 + 3 + c] + row1[x * 6 + c] + row1[x * 6 + 3 + c] + 2) >> 2
+          );
+        }
+      }
+    }
+  }
+  // RGBのwidthピクセル分の行を左右反転してコピー
+  inline void reverse_pixels(const uint8_t* src, uint8_t* dst, const size_t width) noexcept {
+    size_t x = 0;
+# if defined(__SSSE3__)
+    // 5ピクセル(15バイト)ずつ並びを逆転する。読み込みは1バイト手前(フィルタタイプ or 前のピクセル)から行い、
+    // 書き込みの16バイト目は次の反復で上書きされるので、後ろに1ピクセル以上残っている間だけ使う
+    const __m128i shuffle = _mm_setr_epi8(13, 14, 15, 10, 11, 12, 7, 8, 9, 4, 5, 6, 1, 2, 3, 0);
+    for(; x + 6 <= width; x += 5){
+      const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + (width - x - 5) * 3 - 1));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x * 3), _mm_shuffle_epi8(pixels, shuffle));
+    }
+# endif
+    for(; x < width; x++){
+      std::memcpy(dst + x * 3, src + (width - x - 1) * 3, 3);
+    }
+  }
+}
+
+// 画素ごとの色変換の連鎖。チャネルごとの変換は256要素のLUTに合成されるので、何段つないでも適用コストは1段分
+class PointwiseOps{
+public:
+  // 入力チャネル(またはグレースケールの輝度)をチャネルごとのLUTで写す1段
+  struct Stage{
+    bool grayscale = false; // trueなら3チャネルとも輝度を入力にする
+    std::array<uint8_t, 3> source{0, 1, 2}; // 各出力チャネルが参照する入力チャネル
+    std::array<std::array<uint8_t, 256>, 3> lut;
+    Stage(){
+      for(std::array<uint8_t, 256>& table : lut){
+        for(size_t v = 0; v < 256; v++) table[v] = static_cast<uint8_t>(v);
+      }
+    }
+    bool is_identity() const{
+      if(grayscale || source != std::array<uint8_t, 3>{0, 1, 2}) return false;
+      for(const std::array<uint8_t, 256>& table : lut){
+        for(size_t v = 0; v < 256; v++) if(table[v] != v) return false;
+      }
+      return true;
+    }
+  };
+private:
+  std::vector<Stage> stages_{Stage{}};
+  // channel(-1なら全チャネル)のLUTの後ろに変換fを合成
+  template<typename F>
+  PointwiseOps& map(const int& channel, F&& f){
+    if(channel < -1 || channel > 2){
+      throw std::runtime_error("Channel must be -1, 0, 1 or 2");
+    }
+    for(int c = 0; c < 3; c++){
+      if(channel != -1 && channel != c) continue;
+      for(uint8_t& v : stages_.back().lut[c]){
+        v = static_cast<uint8_t>(std::clamp<long>(std::lround(f(static_cast<double>(v))), 0, 255));
+      }
+    }
+    return *this;
+  }
+public:
+  PointwiseOps& invert(const int& channel = -1){
+    return map(channel, [](const double v){ return 255.0 - v; });
+  }
+  // contrastは128を中心に掛け、brightnessを足す
+  PointwiseOps& brightness_contrast(const double& brightness, const double& contrast, const int& channel = -1){
+    return map(channel, [&](const double v){ return (v - 128.0) * contrast + 128.0 + brightness; });
+  }
+  PointwiseOps& gamma(const double& gamma, const int& channel = -1){
+    return map(channel, [&](const double v){ return 255.0 * std::pow(v / 255.0, 1.0 / gamma); });
+  }
+  // [in_black, in_white]をgamma補正しつつ[out_black, out_white]へ写す
+  PointwiseOps& levels(const uint8_t& in_black, const uint8_t& in_white, const double& gamma,
+                       const uint8_t& out_black, const uint8_t& out_white, const int& channel = -1){
+    if(in_white <= in_black){
+      throw std::runtime_error("Input white level must be greater than black level");
+    }
+    return map(channel, [&](const double v){
+      const double t = std::clamp((v - in_black) / (in_white - in_black), 0.0, 1.0);
+      return out_black + (out_white - out_black) * std::pow(t, 1.0 / gamma);
+    });
+  }
+  // 出力チャネルcに入力チャネルorder[c]を入れる(例: {2, 1, 0}でRとBを入れ替え)
+  PointwiseOps& swap_channels(const std::array<uint8_t, 3>& order){
+    if(order[0] > 2 || order[1] > 2 || order[2] > 2){
+      throw std::runtime_error("Channel order must be a permutation of 0, 1, 2");
+    }
+    Stage& stage = stages_.back();
+    const Stage before = stage;
+    for(int c = 0; c < 3; c++){
+      stage.source[c] = before.source[order[c]];
+      stage.lut[c] = before.lut[order[c]];
+    }
+    return *this;
+  }
+  // ITU-R BT.601の係数で輝度にする。チャネル間で混ざるので、それまでの変換があれば段を分ける
+  PointwiseOps& grayscale(void){
+    if(!stages_.back().is_identity()) stages_.emplace_back();
+    stages_.back().grayscale = true;
+    return *this;
+  }
+  const std::vector<Stage>& stages() const { return stages_; }
+};
+
+namespace utils{
+  // フィルタタイプの後ろから始まるwidthピクセル分の行に、色変換の全段を適用
+  inline void apply_pointwise_row(const std::vector<PointwiseOps::Stage>& stages, uint8_t* row, const size_t width) noexcept {
+    for(const PointwiseOps::Stage& stage : stages){
+      const uint8_t* lut_r = stage.lut[0].data();
+      const uint8_t* lut_g = stage.lut[1].data();
+      const uint8_t* lut_b = stage.lut[2].data();
+      if(stage.grayscale){
+        for(uint8_t* p = row; p < row + width * 3; p += 3){
+          const uint8_t luma = static_cast<uint8_t>((77 * p[0] + 150 * p[1] + 29 * p[2] + 128) >> 8);
+          p[0] = lut_r[luma];
+          p[1] = lut_g[luma];
+          p[2] = lut_b[luma];
+        }
+      }else if(stage.source == std::array<uint8_t, 3>{0, 1, 2}){
+        for(uint8_t* p = row; p < row + width * 3; p += 3){
+          p[0] = lut_r[p[0]];
+          p[1] = lut_g[p[1]];
+          p[2] = lut_b[p[2]];
+        }
+      }else{
+        const std::array<uint8_t, 3>& source = stage.source;
+        for(uint8_t* p = row; p < row + width * 3; p += 3){
+          const uint8_t pixel[3] = {p[0], p[1], p[2]};
+          p[0] = lut_r[pixel[source[0]]];
+          p[1] = lut_g[pixel[source[1]]];
+          p[2] = lut_b[pixel[source[2]]];
+        }
+      }
+    }
+  }
+}
+
+// 画像上の矩形(画素単位)
+struct Rect{
+  uint32_t y = 0;
+  uint32_t x = 0;
+  uint32_t height = 0;
+  uint32_t width = 0;
+};
+
+// srcの矩形を(dst_y, dst_x)を左上とする位置へ写す
+struct BlitOp{
+  Rect src;
+  uint32_t dst_y = 0;
+  uint32_t dst_x = 0;
+};
+
+// 重複検出用の指紋
+struct Fingerprint{
+  uint64_t checksum = 0; // 画素内容(フィルタ・圧縮方法によらない)のチェックサム
+  uint64_t dhash = 0; // 9×8輝度グリッドの横方向差分ハッシュ(dHash)
+};
+
+// チャネル(R, G, B)ごとの画素値の統計
+struct Statistics{
+  std::array<std::array<uint64_t, 256>, 3> histogram{}; // [チャネル][値]ごとの画素数
+  std::array<uint8_t, 3> min{};
+  std::array<uint8_t, 3> max{};
+  std::array<double, 3> mean{};
+  uint64_t num_pixels = 0;
+};
+
+namespace utils{
+  // 行ごとにヒストグラムを積み上げる作業領域
+  // 同じビンへの連続した加算がストアフォワーディング待ちにならないよう、隣り合う画素を4つの部分ヒストグラムに振り分ける
+  struct HistogramAccumulator{
+    std::array<std::array<std::array<uint32_t, 256>, 3>, 4> sub{}; // [部分][チャネル][値]
+    std::array<std::array<uint64_t, 256>, 3> total{};
+    uint64_t pending = 0; // 部分ヒストグラムに溜まっている画素数
+    void add_row(const uint8_t* pixels, const size_t width) noexcept {
+      size_t x = 0;
+      for(; x + 4 <= width; x += 4){
+        const uint8_t* p = pixels + x * 3;
+        for(int k = 0; k < 4; k++){
+          sub[k][0][p[k*3]]++;
+          sub[k][1][p[k*3+1]]++;
+          sub[k][2][p[k*3+2]]++;
+        }
+      }
+      for(; x < width; x++){
+        sub[0][0][pixels[x*3]]++;
+        sub[0][1][pixels[x*3+1]]++;
+        sub[0][2][pixels[x*3+2]]++;
+      }
+      // 32ビットのビンが溢れる前に畳み込む
+      pending += width;
+      if(pending >= (UINT64_C(1) << 31)) flush();
+    }
+    void flush() noexcept {
+      for(std::array<std::array<uint32_t, 256>, 3>& part : sub){
+        for(int c = 0; c < 3; c++){
+          for(int v = 0; v < 256; v++) total[c][v] += part[c][v];
+          part[c].fill(0);
+        }
+      }
+      pending = 0;
+    }
+  };
+  // ヒストグラムから最小・最大・平均を求める
+  inline void finalize_statistics(Statistics& stats) noexcept {
+    for(int c = 0; c < 3; c++){
+      uint64_t count = 0;
+      uint64_t sum = 0;
+      int lo = -1, hi = -1;
+      for(int v = 0; v < 256; v++){
+        const uint64_t n = stats.histogram[c][v];
+        if(n == 0) continue;
+        if(lo < 0) lo = v;
+        hi = v;
+        count += n;
+        sum += n * v;
+      }
+      stats.min[c] = static_cast<uint8_t>(std::max(lo, 0));
+      stats.max[c] = static_cast<uint8_t>(std::max(hi, 0));
+      stats.mean[c] = count ? static_cast<double>(sum) / count : 0.0;
+      stats.num_pixels = count;
+    }
+  }
+  // 指紋を行ごとに集める作業領域。行の値は別々に持って最後に順に畳み込むので、行は任意の順・並列に取り込んでよい
+  struct FingerprintAccumulator{
+    uint32_t width = 0;
+    uint32_t height = 0;
+    std::vector<uint64_t> row_checksums; // 行ごとの(CRC-32 << 32 | Adler-32)
+    std::vector<std::array<uint32_t, 9>> row_luma_sums; // 行ごと・dHashグリッド列ごとの輝度の和
+    std::vector<uint8_t> luma_cell_x; // 各列が属するdHashグリッドの列
+    void prepare(const uint32_t image_height, const uint32_t image_width){
+      height = image_height;
+      width = image_width;
+      row_checksums.assign(height, 0);
+      row_luma_sums.assign(height, std::array<uint32_t, 9>{});
+      luma_cell_x.resize(width);
+      for(size_t x = 0; x < width; x++){
+        luma_cell_x[x] = static_cast<uint8_t>(x * 9 / width);
+      }
+    }
+    // フィルター解除直後のy行目の画素(フィルタタイプの次から)を取り込む
+    void add_row(const size_t y, const uint8_t* row) noexcept {
+      const uInt row_bytes = width * 3;
+      const uint64_t crc = crc32(crc32(0L, Z_NULL, 0), row, row_bytes);
+      const uint64_t adler = adler32(adler32(0L, Z_NULL, 0), row, row_bytes);
+      row_checksums[y] = (crc << 32) | adler;
+      std::array<uint32_t, 9>& sums = row_luma_sums[y];
+      for(size_t x = 0; x < width; x++){
+        const uint8_t* p = row + x * 3;
+        sums[luma_cell_x[x]] += (77 * p[0] + 150 * p[1] + 29 * p[2] + 128) >> 8;
+      }
+    }
+    // 行ごとの値を畳み込んで指紋を確定し、作業領域を手放す
+    Fingerprint finalize(void){
+      // チェックサム: 画像サイズと行ごとの値を順に混ぜる
+      const auto mix = [](uint64_t h){ // splitmix64の最終段
+        h = (h ^ (h >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+        h = (h ^ (h >> 27)) * UINT64_C(0x94D049BB133111EB);
+        return h ^ (h >> 31);
+      };
+      uint64_t checksum = mix((static_cast<uint64_t>(width) << 32) | height);
+      for(const uint64_t row_checksum : row_checksums){
+        checksum = mix(checksum ^ row_checksum);
+      }
+      // dHash: 9×8グリッドの平均輝度を左右で比べる
+      std::array<std::array<uint64_t, 9>, 8> cell_sums{};
+      std::array<uint64_t, 8> cell_rows{};
+      std::array<uint64_t, 9> cell_cols{};
+      for(size_t y = 0; y < height; y++){
+        const size_t cell_y = y * 8 / height;
+        cell_rows[cell_y]++;
+        for(size_t c = 0; c < 9; c++) cell_sums[cell_y][c] += row_luma_sums[y][c];
+      }
+      for(const uint8_t cell_x : luma_cell_x) cell_cols[cell_x]++;
+      uint64_t dhash = 0;
+      for(size_t r = 0; r < 8; r++){
+        for(size_t c = 0; c < 8; c++){
+          const uint64_t count_left = cell_rows[r] * cell_cols[c];
+          const uint64_t count_right = cell_rows[r] * cell_cols[c+1];
+          // 平均の比較は交差乗算で行う(空のセルは0扱い)
+          const bool brighter = count_left != 0 && count_right != 0
+            && cell_sums[r][c] * count_right > cell_sums[r][c+1] * count_left;
+          dhash = (dhash << 1) | (brighter ? 1 : 0);
+        }
+      }
+      row_checksums.clear();
+      row_checksums.shrink_to_fit();
+      row_luma_sums.clear();
+      row_luma_sums.shrink_to_fit();
+      return Fingerprint{checksum, dhash};
+    }
+  };
+}
 
 class PNG{
 private:
@@ -26,28 +730,101 @@ private:
   uint32_t height_ = 0;
   std::vector<char> data_;
   std::vector<Chunk> chunks_;
+  size_t ihdr_index_ = 0; // chunks_上のIHDRの位置
+  std::vector<size_t> idat_indices_; // chunks_上のIDATの位置(出現順)
   std::vector<uint8_t> image_data_compressed_;
   std::vector<uint8_t> image_data_decompressed_;
   std::vector<uint8_t> image_data_decompressed_nofilter_;
+  bool nofilter_valid_ = false; // フィルター解除済みデータが最新かどうか
+  uint32_t index_interval_ = 0; // pIdXを書き出す行間隔(0なら書き出さない)
+  std::vector<std::pair<uint32_t, uint32_t>> index_entries_; // 圧縮時に記録した(開始行, オフセット)
+  uint16_t palette_colors_ = 0; // パレット画像で書き出すときの最大色数(0ならRGBで書き出す)
+  bool optimize_ = false; // 試し圧縮で出力サイズが最小の設定を探すかどうか
+  uint32_t optimize_budget_ms_ = 0; // 探索に使う時間の目安(0なら無制限)
+  std::vector<fcTL> frame_controls_; // APNGの各フレームの制御情報(静止画なら空)
+  bool default_is_frame_ = false; // IDATの既定画像がアニメーションの先頭フレームを兼ねるかどうか
+  uint32_t num_plays_ = 0; // ループ回数(0なら無限)
+  std::vector<PNG> frames_; // 既定画像以外のフレーム(キャンバス全面に合成済み)
+  bool encoded_ = true; // IDAT・圧縮データが現在の画素を表しているかどうか(読み込んだだけのフレームはfalse)
+  bool fingerprint_enabled_ = false; // フィルター解除と同時に指紋を計算するかどうか
+  utils::FingerprintAccumulator fingerprint_rows_; // 指紋計算用の行ごとの値
+  Fingerprint fingerprint_;
+  bool statistics_enabled_ = false; // フィルター解除と同時にヒストグラムを集計するかどうか
+  bool statistics_valid_ = false; // statistics_が現在の画素の統計かどうか
+  Statistics statistics_;
   void decompress_data(void); // データを解凍
-  void compress_data(void); // データを圧縮
+  bool decompress_data_indexed(const pIdX& index); // pIdXを使って区間ごとに並列解凍
+  void expand_palette(const uint8_t bit_depth); // パレット画像の解凍データをフィルターなしのRGB行に展開
+  void compress_data(const utils::DeflateParams& params = {}); // データを圧縮
   void unset_filter(void); // データのフィルターを外す
-  void set_filter(void); // データにフィルターをかける
+  void unset_filter_rows(const size_t y_begin, const size_t y_end, utils::HistogramAccumulator* histogram = nullptr); // 指定行範囲のフィルターを外す(histogramがあれば同時に集計)
+  void finalize_fingerprint(void); // 行ごとの値を畳み込んで指紋を確定
+  void merge_statistics(utils::HistogramAccumulator& histogram); // 区間ごとのヒストグラムを統計に加える(並列処理の後に順に呼ぶ)
+  void set_filter(const utils::FilterStrategy strategy = utils::FilterStrategy::ADAPTIVE); // データにフィルターをかける
+  void optimize_compression(void); // フィルター・deflate設定を試し圧縮で探し、最も小さくなったもので圧縮
+  void set_palette_data(void); // 減色してパレット番号の行を作り、IHDR・PLTEを更新
+  void load(void); // data_のチャンク読み込みから解凍まで
   void load_chunks(void); // チャンク読み込み
+  void index_chunks(void); // IHDR・IDATの位置を記録し直す
+  IHDR& ihdr(void) { return std::get<IHDR>(chunks_[ihdr_index_].data()); }
+  const IHDR& ihdr(void) const { return std::get<IHDR>(chunks_[ihdr_index_].data()); }
   void extract_image_data(void); // 画像データを抽出
-  void delete_idat(void); // チャンク配列からIDATチャンクを削除
-  void insert_idat(void); // チャンク配列にIDATチャンクを追加
+  void load_frames(void); // APNGのフレームを並列に解凍し、キャンバス全面に合成
+  void delete_idat(void); // チャンク配列からIDAT,pIdXチャンクを削除
+  void insert_idat(void); // チャンク配列にIDAT,pIdXチャンクを追加
   void insert_text(const std::string& keyword, const std::string& text); // チャンク配列にtEXTチャンクを追加
+  void replace_plte(const std::vector<std::array<uint8_t, 3>>& palette); // PLTEチャンクを差し替え(空なら削除のみ)
+  void encode(void); // フィルター・圧縮してIDATチャンクを差し替え
+  void encode_animation(void); // acTL・fcTL・fdATチャンクを現在のフレームで作り直す
+  template<typename F>
+  void apply_to_frames(F&& operation); // 既定画像以外の各フレームに並列で操作を適用
+  template<typename T>
+  static Chunk make_chunk(const uint32_t type, const std::string& type_string, const std::vector<char>& data); // CRC付きのチャンクを生成
+  void resize_header(const uint32_t height, const uint32_t width); // 画像サイズとIHDRチャンクを更新
+  void transpose_tiled(const bool reverse_x, const bool reverse_y); // タイル単位で縦横を入れ替え
+  void convolve_fixed(const std::vector<int32_t>& kernel_x, const std::vector<int32_t>& kernel_y); // Q14固定小数点の分離可能畳み込み
+  void box_blur_pass(const uint32_t radius); // スライディングウィンドウによる箱型ぼかし1回分
+  void gaussian_blur_pass(const double sigma); // ガウスぼかし(エンコードなし)
+  void check_blit(const BlitOp& op) const; // 矩形が転送元・転送先とも画像内に収まるか確認
+  void blit_rows(const std::vector<BlitOp>& ops); // 行ごとのmemcpyでまとめて転送(エンコードなし)
+  PNG() = default;
+  PNG derive(std::vector<uint8_t>&& image_data_nofilter, const uint32_t height, const uint32_t width) const; // 付随チャンクを引き継いだ別画像を作成
 public:
-  explicit PNG(const std::string& path);
+  explicit PNG(const std::string& path, const bool& fingerprint = false); // fingerprintがtrueならデコード中に指紋を計算
+  explicit PNG(const std::vector<char>& data, const bool& fingerprint = false); // メモリ上のファイル内容から読み込む
+  static Fingerprint probe(const std::string& path); // デコード1回分で指紋だけを得る
+  const Fingerprint& fingerprint(void) const { return fingerprint_; }
+  const Statistics& statistics(void); // 未解除ならフィルター解除と同時に、解除済みなら帯ごとに並列で集計(結果は次の変更まで保持)
+  void auto_levels(const double& clip = 0.0); // 上下clipの割合の画素を飽和させ、チャネルごとに0〜255へ伸ばす
   void reverse_color(void);
+  void apply(const PointwiseOps& ops); // 色変換の連鎖を1パスで適用
   void resize_data(const double& scale_height, const double& scale_width);
-  void collapse(const int& shuffle_num);
+  void blit(const Rect& src, const uint32_t& dst_y, const uint32_t& dst_x); // 矩形を移動(重なっていてもよい)
+  void blit(const std::vector<BlitOp>& ops); // 全矩形を呼び出し前の画像から読み、後の矩形ほど上に書く
+  void collapse(const int& shuffle_num, const uint64_t& seed = std::random_device{}()); // ランダムな矩形の貼り付けをshuffle_num回(seedで再現可能)
+  void rotate(const int& degree); // 時計回りに90の倍数だけ回転
+  void flip_horizontal(void);
+  void flip_vertical(void);
+  void transpose(void);
+  void crop(const uint32_t& y, const uint32_t& x, const uint32_t& height, const uint32_t& width);
+  void convolve(const std::vector<double>& kernel_x, const std::vector<double>& kernel_y); // 奇数長の横・縦カーネルで畳み込み
+  void box_blur(const uint32_t& radius);
+  void gaussian_blur(const double& sigma);
+  void unsharp_mask(const double& sigma, const double& amount, const uint8_t& threshold = 0);
+  std::vector<PNG> pyramid(const size_t& levels); // 1/2, 1/4, ... に縮小した画像をlevels枚
+  std::vector<PNG> thumbnails(const std::vector<std::pair<uint32_t, uint32_t>>& sizes); // (高さ, 幅)ごとの縮小画像
+  void set_index_interval(const uint32_t& interval); // 以降の圧縮でinterval行ごとに全フラッシュし索引を付ける
+  void set_palette_colors(const uint16_t& max_colors); // 以降の圧縮でmax_colors色(1〜256)以下のパレット画像にする。0でRGBに戻す
+  void set_optimize(const bool& enabled, const uint32_t& time_budget_ms = 0); // 以降の圧縮で試し圧縮により出力サイズを最小化する(time_budget_msは探索時間の目安)
+  size_t num_frames(void) const { return frame_controls_.size(); } // APNGのフレーム数(静止画なら0)
+  PNG frame(const size_t& index); // index番目のフレームを単独の静止画として返す(acTL・fcTL・fdATは含まない)
+  std::pair<uint16_t, uint16_t> frame_delay(const size_t& index) const; // index番目のフレームの表示時間(分子, 分母)
+  uint32_t num_plays(void) const { return num_plays_; }
   void write(const std::string& path) const;
   void debug(void) const;
 };
 
-PNG::PNG(const std::string& path){
+PNG::PNG(const std::string& path, const bool& fingerprint) : fingerprint_enabled_(fingerprint){
   // バイナリ読み込み
   std::ifstream ifs(path, std::ios::in | std::ios::binary);
   if(!ifs){
@@ -60,21 +837,44 @@ PNG::PNG(const std::string& path){
   // 読み込んだデータをvector<char>型に変換
   data_.resize(size_);
   ifs.read(data_.data(), size_);
+  load();
+}
+
+PNG::PNG(const std::vector<char>& data, const bool& fingerprint) : size_(data.size()), data_(data), fingerprint_enabled_(fingerprint){
+  load();
+}
+
+void PNG::load(void){
   load_chunks();
   extract_image_data();
   decompress_data();
+  load_frames();
+  // 指紋はフィルター解除の行ループの中で計算するので、ここで解除まで済ませる
+  if(fingerprint_enabled_){
+    unset_filter();
+  }
+}
+
+Fingerprint PNG::probe(const std::string& path){
+  return PNG{path, true}.fingerprint();
 }
 
 void PNG::load_chunks(){
   uint64_t binary_idx = 8;  // PNGシグネチャの後の位置
   Chunk chunk;
   do {
+    if(binary_idx + BYTE_LENGTH + BYTE_TYPE + BYTE_CRC > size_){
+      throw std::runtime_error("Unexpected end of file");
+    }
     // チャンクのデータ長のみ先に取得
     uint32_t chunk_length = 0;
     for(int i = 0; i < BYTE_LENGTH; ++i){
       chunk_length = (chunk_length << 8) | static_cast<uint8_t>(data_[binary_idx + i]);
     }
     uint64_t chunk_total_size = BYTE_LENGTH + BYTE_TYPE + chunk_length + BYTE_CRC;
+    if(binary_idx + chunk_total_size > size_){
+      throw std::runtime_error("Unexpected end of file");
+    }
     // チャンク生成
     std::vector<char> chunk_data(chunk_total_size);
     std::copy(
@@ -85,230 +885,448 @@ void PNG::load_chunks(){
     chunk.initialize();
     binary_idx += chunk.set(chunk_data);
     chunks_.push_back(chunk);
-  } while (not utils::equal_stri(chunk.type_string(), "IEND"));
+  } while (chunk.type() != TYPE_IEND);
+  index_chunks();
+}
+
+void PNG::index_chunks(void){
+  bool has_ihdr = false;
+  idat_indices_.clear();
+  for(size_t i = 0; i < chunks_.size(); i++){
+    switch(chunks_[i].type()){
+      case TYPE_IHDR: ihdr_index_ = i; has_ihdr = true; break;
+      case TYPE_IDAT: idat_indices_.push_back(i); break;
+      default: break;
+    }
+  }
+  if(!has_ihdr){
+    throw std::runtime_error("IHDR chunk not found");
+  }
 }
 
 void PNG::extract_image_data(){
+  for(const size_t i : idat_indices_){
+    const IDAT& idat = std::get<IDAT>(chunks_[i].data());
+    image_data_compressed_.insert(
+      image_data_compressed_.end(),
+      idat.image_data().begin(),
+      idat.image_data().end()
+    );
+  }
+}
+
+void PNG::load_frames(){
+  // チャンクの並びからフレームごとの制御情報と圧縮データを集める
+  bool has_animation_control = false;
+  bool seen_idat = false;
+  std::vector<std::vector<uint8_t>> frame_data;
   for(const Chunk& chunk : chunks_){
-    if(utils::equal_stri(chunk.type_string(), "IDAT")){
-      const IDAT& idat = std::get<IDAT>(chunk.data());
-      image_data_compressed_.insert(
-        image_data_compressed_.end(),
-        idat.image_data().begin(),
-        idat.image_data().end()
-      );
+    switch(chunk.type()){
+      case TYPE_acTL:{
+        has_animation_control = true;
+        num_plays_ = std::get<acTL>(chunk.data()).num_plays();
+        break;
+      }
+      case TYPE_fcTL:{
+        // IDATより前のfcTLは既定画像をフレームとして扱う指定
+        if(frame_controls_.empty() && !seen_idat) default_is_frame_ = true;
+        frame_controls_.push_back(std::get<fcTL>(chunk.data()));
+        frame_data.emplace_back();
+        break;
+      }
+      case TYPE_IDAT:{
+        seen_idat = true;
+        break;
+      }
+      case TYPE_fdAT:{
+        if(frame_data.empty()){
+          throw std::runtime_error("fdAT chunk before fcTL");
+        }
+        const std::vector<uint8_t>& data = std::get<fdAT>(chunk.data()).frame_data();
+        frame_data.back().insert(frame_data.back().end(), data.begin(), data.end());
+        break;
+      }
+      default: break;
+    }
+  }
+  // acTLがなければ普通のPNGとして扱う
+  if(!has_animation_control || frame_controls_.empty()){
+    frame_controls_.clear();
+    default_is_frame_ = false;
+    return;
+  }
+  for(const fcTL& control : frame_controls_){
+    if(control.width() == 0 || control.height() == 0
+       || static_cast<uint64_t>(control.x_offset()) + control.width() > width_
+       || static_cast<uint64_t>(control.y_offset()) + control.height() > height_){
+      throw std::runtime_error("Invalid frame region");
+    }
+  }
+  // 各フレームは独立したzlibストリームなので並列に解凍・フィルター解除できる
+  const size_t first = default_is_frame_ ? 1 : 0;
+  std::vector<PNG> subframes;
+  subframes.reserve(frame_controls_.size() - first);
+  for(size_t k = first; k < frame_controls_.size(); k++){
+    subframes.push_back(derive({}, frame_controls_[k].height(), frame_controls_[k].width()));
+    subframes.back().nofilter_valid_ = false;
+    subframes.back().image_data_compressed_ = std::move(frame_data[k]);
+  }
+  utils::parallel_for(subframes.size(), [&](const size_t i){
+    subframes[i].decompress_data();
+    subframes[i].unset_filter();
+  });
+  unset_filter();
+  // 合成は前のフレームの表示後の状態に依存するので順に行う(行単位のコピーのみ)
+  // アルファを持たないので、キャンバスの初期状態と背景での消去は黒、BLEND_OVERは上書きと同じ
+  const size_t width_data = width_ * 3 + 1;
+  std::vector<uint8_t> canvas(width_data * height_, 0);
+  std::vector<uint8_t> saved;
+  frames_.clear();
+  frames_.reserve(subframes.size());
+  for(size_t k = 0; k < frame_controls_.size(); k++){
+    const fcTL& control = frame_controls_[k];
+    const std::vector<uint8_t>& src = (k < first) ? image_data_decompressed_nofilter_ : subframes[k - first].image_data_decompressed_nofilter_;
+    const size_t src_width_data = control.width() * 3 + 1;
+    const size_t row_bytes = control.width() * 3;
+    const auto region_row = [&](const size_t y){
+      return canvas.data() + (control.y_offset() + y) * width_data + 1 + control.x_offset() * 3;
+    };
+    if(control.dispose_op() == fcTL::DISPOSE_PREVIOUS){
+      saved.resize(row_bytes * control.height());
+      for(size_t y = 0; y < control.height(); y++){
+        std::memcpy(saved.data() + y * row_bytes, region_row(y), row_bytes);
+      }
+    }
+    for(size_t y = 0; y < control.height(); y++){
+      std::memcpy(region_row(y), src.data() + y * src_width_data + 1, row_bytes);
+    }
+    if(k >= first){
+      frames_.push_back(derive(std::vector<uint8_t>(canvas), height_, width_));
+      frames_.back().index_interval_ = 0;
+      frames_.back().encoded_ = false;
+    }
+    if(control.dispose_op() == fcTL::DISPOSE_BACKGROUND || (control.dispose_op() == fcTL::DISPOSE_PREVIOUS && k == 0)){
+      for(size_t y = 0; y < control.height(); y++){
+        std::memset(region_row(y), 0, row_bytes);
+      }
+    }else if(control.dispose_op() == fcTL::DISPOSE_PREVIOUS){
+      for(size_t y = 0; y < control.height(); y++){
+        std::memcpy(region_row(y), saved.data() + y * row_bytes, row_bytes);
+      }
     }
   }
+  // 符号化はフレームを書き換えたとき(またはframeで取り出したとき)まで遅らせる。変更がなければ元のチャンクをそのまま書き出す
 }
 
 void PNG::decompress_data(){
+  // IHDRから画像サイズを取得
+  width_ = ihdr().width();
+  height_ = ihdr().height();
+  const uint8_t bit_depth = ihdr().bit_depth();
+  const uint8_t color_type = ihdr().color_type();
+  const bool is_palette = color_type == 3;
+  if(is_palette && bit_depth != 1 && bit_depth != 2 && bit_depth != 4 && bit_depth != 8){
+    throw std::runtime_error("Invalid bit depth for palette image");
+  }
+  // 解凍後のデータサイズを計算
+  size_t decompressed_size = is_palette
+    ? ((static_cast<size_t>(width_) * bit_depth + 7) / 8 + 1) * height_  // パレット番号の場合
+    : static_cast<size_t>(width_) * height_ * 3 + height_;  // RGB形式の場合
+  image_data_decompressed_.resize(decompressed_size);
+  nofilter_valid_ = false;
+  if(fingerprint_enabled_){
+    fingerprint_rows_.prepare(height_, width_);
+  }
+  // 自前で書き出した索引があれば区間ごとに並列で解凍する
+  for(const Chunk& chunk : chunks_){
+    if(!is_palette && (chunk.type() == TYPE_pIdX || chunk.type() == TYPE_pIDX)){
+      const pIdX& index = std::get<pIdX>(chunk.data());
+      if(decompress_data_indexed(index)){
+        index_interval_ = index.interval();
+        return;
+      }
+      break;
+    }
+  }
   z_stream strm;
   strm.zalloc = Z_NULL;
   strm.zfree = Z_NULL;
   strm.opaque = Z_NULL;
-  strm.avail_in = image_data_compressed_.size();
+  strm.avail_in = 0;
   strm.next_in = reinterpret_cast<Bytef*>(image_data_compressed_.data());
   if(inflateInit(&strm) != Z_OK){
     throw std::runtime_error("inflateInit failed");
   }
-  // IHDRから画像サイズを取得
-  for(const Chunk& chunk : chunks_){
-    if (utils::equal_stri(chunk.type_string(), "IHDR")){
-      const IHDR& ihdr = std::get<IHDR>(chunk.data());
-      width_ = ihdr.width();
-      height_ = ihdr.height();
-      break;
+  strm.avail_out = 0;
+  strm.next_out = reinterpret_cast<Bytef*>(image_data_decompressed_.data());
+  // avail_in/avail_outは32ビットなので、4GiBを超える画像は分けて渡す
+  size_t in_left = image_data_compressed_.size();
+  size_t out_left = decompressed_size;
+  int ret = Z_OK;
+  while(ret == Z_OK){
+    if(strm.avail_in == 0 && in_left > 0){
+      strm.avail_in = static_cast<uInt>(std::min<size_t>(in_left, UINT32_MAX));
+      in_left -= strm.avail_in;
     }
+    if(strm.avail_out == 0 && out_left > 0){
+      strm.avail_out = static_cast<uInt>(std::min<size_t>(out_left, UINT32_MAX));
+      out_left -= strm.avail_out;
+    }
+    ret = inflate(&strm, Z_NO_FLUSH);
   }
-  // 解凍後のデータサイズを計算
-  size_t decompressed_size = width_ * height_ * 3 + height_;  // RGB形式の場合
-  image_data_decompressed_.resize(decompressed_size);
-  strm.avail_out = decompressed_size;
-  strm.next_out = reinterpret_cast<Bytef*>(image_data_decompressed_.data());
-  int ret = inflate(&strm, Z_FINISH);
   if(ret != Z_STREAM_END){
     inflateEnd(&strm);
     throw std::runtime_error("inflate failed");
   }
-  image_data_decompressed_.resize(decompressed_size - strm.avail_out);
+  image_data_decompressed_.resize(decompressed_size - out_left - strm.avail_out);
   inflateEnd(&strm);
+  if(is_palette){
+    expand_palette(bit_depth);
+  }
 }
 
-void PNG::compress_data(){
-  z_stream strm;
-  strm.zalloc = Z_NULL;
-  strm.zfree = Z_NULL;
-  strm.opaque = Z_NULL;
-  strm.avail_in = image_data_decompressed_.size();
-  strm.next_in = reinterpret_cast<Bytef*>(image_data_decompressed_.data());
-  if(deflateInit(&strm, Z_DEFAULT_COMPRESSION) != Z_OK){
-    throw std::runtime_error("deflateInit failed");
-  }
-  size_t compressed_size = static_cast<size_t>(image_data_decompressed_.size() * 1.1) + 12;
-  image_data_compressed_.resize(compressed_size);
-  strm.avail_out = compressed_size;
-  strm.next_out = reinterpret_cast<Bytef*>(image_data_compressed_.data());
-  int ret = deflate(&strm, Z_FINISH);
-  if(ret != Z_STREAM_END){
-    deflateEnd(&strm);
-    throw std::runtime_error("deflate failed");
+void PNG::expand_palette(const uint8_t bit_depth){
+  const PLTE* plte = nullptr;
+  for(const Chunk& chunk : chunks_){
+    if(chunk.type() == TYPE_PLTE){
+      plte = &std::get<PLTE>(chunk.data());
+      break;
+    }
+  }
+  if(plte == nullptr){
+    throw std::runtime_error("PLTE chunk not found");
+  }
+  const size_t packed_width = (static_cast<size_t>(width_) * bit_depth + 7) / 8 + 1;
+  if(image_data_decompressed_.size() != packed_width * height_){
+    throw std::runtime_error("Invalid image data size");
+  }
+  // パレット番号→RGBの表(パレットにない番号は黒)
+  std::array<std::array<uint8_t, 3>, 256> colors{};
+  for(size_t i = 0; i < std::min<size_t>(plte->palettes().size(), 256); i++){
+    colors[i] = {plte->palettes()[i][0], plte->palettes()[i][1], plte->palettes()[i][2]};
+  }
+  // パレット画像のフィルターは1バイト単位。フィルターを外してからRGBに展開し、以降はフィルターなしのRGB画像として扱う
+  const size_t width_data = width_ * 3 + 1;
+  std::vector<uint8_t> rgb(width_data * height_);
+  std::vector<uint8_t> indices(width_);
+  for(size_t y = 0; y < height_; y++){
+    uint8_t* packed = image_data_decompressed_.data() + y * packed_width;
+    utils::unfilter_row<1>(packed, y > 0 ? packed - packed_width : nullptr, packed, packed_width);
+    utils::unpack_indices(packed + 1, indices.data(), width_, bit_depth);
+    uint8_t* out = rgb.data() + y * width_data;
+    out[0] = 0;
+    for(size_t x = 0; x < width_; x++){
+      std::memcpy(out + 1 + x * 3, colors[indices[x]].data(), 3);
+    }
+  }
+  image_data_decompressed_ = std::move(rgb);
+}
+
+bool PNG::decompress_data_indexed(const pIdX& index){
+  const std::vector<std::pair<uint32_t, uint32_t>>& entries = index.entries();
+  const size_t width_data = width_ * 3 + 1;
+  const size_t compressed_size = image_data_compressed_.size();
+  const size_t num_segments = entries.size();
+  // zlibヘッダ(プリセット辞書なし)と索引の整合性を確認
+  if(num_segments == 0 || compressed_size < 6) return false;
+  const uint8_t cmf = image_data_compressed_[0];
+  const uint8_t flg = image_data_compressed_[1];
+  if((cmf & 0x0F) != 8 || ((cmf << 8) | flg) % 31 != 0 || (flg & 0x20)) return false;
+  if(entries[0].first != 0 || entries[0].second != 2) return false;
+  for(size_t i = 1; i < num_segments; i++){
+    if(entries[i].first <= entries[i-1].first || entries[i].first >= height_) return false;
+    if(entries[i].second <= entries[i-1].second || entries[i].second >= compressed_size - 4) return false;
+  }
+  image_data_decompressed_nofilter_.resize(image_data_decompressed_.size());
+  std::vector<uLong> adlers(num_segments);
+  std::vector<uint8_t> succeeded(num_segments, 0);
+  std::vector<utils::HistogramAccumulator> histograms(statistics_enabled_ ? num_segments : 0);
+  utils::parallel_for(num_segments, [&](const size_t i){
+    const bool is_last = i + 1 == num_segments;
+    const size_t row_begin = entries[i].first;
+    const size_t row_end = is_last ? height_ : entries[i+1].first;
+    const size_t in_begin = entries[i].second;
+    const size_t in_end = is_last ? compressed_size - 4 : entries[i+1].second;
+    const size_t out_size = (row_end - row_begin) * width_data;
+    uint8_t* out = image_data_decompressed_.data() + row_begin * width_data;
+    // 全フラッシュ境界からは辞書なしの生deflateとして解凍できる
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = in_end - in_begin;
+    strm.next_in = reinterpret_cast<Bytef*>(image_data_compressed_.data() + in_begin);
+    if(inflateInit2(&strm, -MAX_WBITS) != Z_OK) return;
+    strm.avail_out = out_size;
+    strm.next_out = reinterpret_cast<Bytef*>(out);
+    const int ret = inflate(&strm, is_last ? Z_FINISH : Z_SYNC_FLUSH);
+    const bool inflated = is_last ? ret == Z_STREAM_END : (ret == Z_OK || ret == Z_BUF_ERROR);
+    const bool exact = strm.avail_out == 0 && strm.avail_in == 0;
+    inflateEnd(&strm);
+    // 区間の先頭行は上の行を参照しないフィルタ(None/Sub)でなければならない
+    if(!inflated || !exact || out[0] > 1) return;
+    unset_filter_rows(row_begin, row_end, statistics_enabled_ ? &histograms[i] : nullptr);
+    adlers[i] = adler32(adler32(0L, Z_NULL, 0), out, out_size);
+    succeeded[i] = 1;
+  });
+  if(std::find(succeeded.begin(), succeeded.end(), 0) != succeeded.end()) return false;
+  // 区間ごとのAdler-32を結合してzlibトレーラと照合
+  uLong adler = adlers[0];
+  for(size_t i = 1; i < num_segments; i++){
+    const size_t row_end = (i + 1 == num_segments) ? height_ : entries[i+1].first;
+    adler = adler32_combine(adler, adlers[i], (row_end - entries[i].first) * width_data);
+  }
+  const uint32_t trailer = utils::vecchar2int(reinterpret_cast<const char*>(image_data_compressed_.data() + compressed_size - 4));
+  if(adler != trailer) return false;
+  for(utils::HistogramAccumulator& histogram : histograms){
+    merge_statistics(histogram);
+  }
+  nofilter_valid_ = true;
+  if(fingerprint_enabled_){
+    finalize_fingerprint();
+  }
+  return true;
+}
+
+void PNG::compress_data(const utils::DeflateParams& params){
+  // パレット画像は行の長さが異なるので索引を付けない
+  const uint32_t segment_rows = palette_colors_ != 0 ? 0 : index_interval_;
+  const size_t width_data = height_ != 0 ? image_data_decompressed_.size() / height_ : 0;
+  utils::deflate_rows(image_data_decompressed_.data(), width_data, height_, params, segment_rows, image_data_compressed_, &index_entries_);
+  if(segment_rows == 0){
+    index_entries_.clear();
   }
-  image_data_compressed_.resize(compressed_size - strm.avail_out);
-  deflateEnd(&strm);
 }
 
 void PNG::unset_filter(void){
+  if(nofilter_valid_) return;
   image_data_decompressed_nofilter_.resize(image_data_decompressed_.size());
+  std::unique_ptr<utils::HistogramAccumulator> histogram;
+  if(statistics_enabled_){
+    histogram = std::make_unique<utils::HistogramAccumulator>();
+  }
+  unset_filter_rows(0, height_, histogram.get());
+  if(histogram){
+    merge_statistics(*histogram);
+  }
+  nofilter_valid_ = true;
+  if(fingerprint_enabled_){
+    finalize_fingerprint();
+  }
+}
+
+void PNG::unset_filter_rows(const size_t y_begin, const size_t y_end, utils::HistogramAccumulator* histogram){
   const size_t width_data = width_ * 3 + 1;
-  const size_t height = height_;
-  // フィルタ処理を最適化
-  for(size_t y = 0; y < height; y++){
+  for(size_t y = y_begin; y < y_end; y++){
     const size_t row_start = y * width_data;
-    const uint8_t filter_type = image_data_decompressed_[row_start];
-    const bool has_prev_row = y > 0;
-    // フィルタタイプに応じた処理
-    switch(filter_type){
-      case 1:{ // Subフィルタ
-        for(size_t x = 1; x < width_data; x++){
-          const size_t i = row_start + x;
-          const uint8_t left = (x >= 3) ? image_data_decompressed_nofilter_[i-3] : 0;
-          image_data_decompressed_nofilter_[i] = (image_data_decompressed_[i] + left) & 0xFF;
-        }
-        break;
-      }
-      case 2:{ // Upフィルタ
-        if(has_prev_row){
-          for(size_t x = 1; x < width_data; x++){
-            const size_t i = row_start + x;
-            image_data_decompressed_nofilter_[i] = (image_data_decompressed_[i] + image_data_decompressed_nofilter_[i-width_data]) & 0xFF;
-          }
-        }else{
-          for(size_t x = 1; x < width_data; x++){
-            image_data_decompressed_nofilter_[row_start + x] = image_data_decompressed_[row_start + x];
-          }
-        }
-        break;
-      }
-      case 3:{ // Averageフィルタ
-        for(size_t x = 1; x < width_data; x++){
-          const size_t i = row_start + x;
-          const uint8_t left = (x >= 3) ? image_data_decompressed_nofilter_[i-3] : 0;
-          const uint8_t up = has_prev_row ? image_data_decompressed_nofilter_[i-width_data] : 0;
-          image_data_decompressed_nofilter_[i] = (image_data_decompressed_[i] + ((left + up) >> 1)) & 0xFF;
-        }
-        break;
-      }
-      case 4:{ // Paethフィルタ
-        for(size_t x = 1; x < width_data; x++){
-          const size_t i = row_start + x;
-          const uint8_t left = (x >= 3) ? image_data_decompressed_nofilter_[i-3] : 0;
-          const uint8_t up = has_prev_row ? image_data_decompressed_nofilter_[i-width_data] : 0;
-          const uint8_t upleft = (x >= 3 && has_prev_row) ? image_data_decompressed_nofilter_[i-width_data-3] : 0;
-          const int p = left + up - upleft;
-          const int pa = std::abs(p - left);
-          const int pb = std::abs(p - up);
-          const int pc = std::abs(p - upleft);
-          const uint8_t predictor = (pa <= pb && pa <= pc) ? left : (pb <= pc ? up : upleft);
-          image_data_decompressed_nofilter_[i] = (image_data_decompressed_[i] + predictor) & 0xFF;
-        }
-        break;
-      }
-      default:{
-        for(size_t x = 1; x < width_data; x++){
-          image_data_decompressed_nofilter_[row_start + x] = image_data_decompressed_[row_start + x];
-        }
+    utils::unfilter_row(
+      image_data_decompressed_.data() + row_start,
+      y > y_begin ? image_data_decompressed_nofilter_.data() + row_start - width_data : nullptr,
+      image_data_decompressed_nofilter_.data() + row_start,
+      width_data
+    );
+    // 行がキャッシュにあるうちに指紋・ヒストグラムへ取り込む
+    if(fingerprint_enabled_){
+      fingerprint_rows_.add_row(y, image_data_decompressed_nofilter_.data() + row_start + 1);
+    }
+    if(histogram){
+      histogram->add_row(image_data_decompressed_nofilter_.data() + row_start + 1, width_);
+    }
+  }
+}
+
+void PNG::merge_statistics(utils::HistogramAccumulator& histogram){
+  histogram.flush();
+  for(int c = 0; c < 3; c++){
+    for(int v = 0; v < 256; v++) statistics_.histogram[c][v] += histogram.total[c][v];
+  }
+}
+
+const Statistics& PNG::statistics(void){
+  if(statistics_valid_) return statistics_;
+  statistics_ = Statistics{};
+  if(!nofilter_valid_){
+    // まだフィルターを外していなければ、その行ループで集計して読み直しを省く
+    statistics_enabled_ = true;
+    try{
+      unset_filter();
+    }catch(...){
+      statistics_enabled_ = false;
+      throw;
+    }
+    statistics_enabled_ = false;
+  }else{
+    const size_t width_data = width_ * 3 + 1;
+    constexpr size_t BAND = 256;
+    // 帯ごとに別のヒストグラムに集計し、並列処理が終わってから足し合わせる(ロック不要)
+    std::vector<utils::HistogramAccumulator> histograms((height_ + BAND - 1) / BAND);
+    utils::parallel_for_bands(height_, BAND, [&](const size_t y_begin, const size_t y_end){
+      utils::HistogramAccumulator& histogram = histograms[y_begin / BAND];
+      for(size_t y = y_begin; y < y_end; y++){
+        histogram.add_row(image_data_decompressed_nofilter_.data() + y * width_data + 1, width_);
       }
+    });
+    for(utils::HistogramAccumulator& histogram : histograms){
+      merge_statistics(histogram);
     }
   }
+  utils::finalize_statistics(statistics_);
+  statistics_valid_ = true;
+  return statistics_;
 }
 
-void PNG::set_filter(void){
+void PNG::finalize_fingerprint(void){
+  fingerprint_ = fingerprint_rows_.finalize();
+  // 指紋は確定したので、以降のフィルター解除では行ごとの値を集めない
+  fingerprint_enabled_ = false;
+}
+
+void PNG::set_filter(const utils::FilterStrategy strategy){
   image_data_decompressed_.resize(image_data_decompressed_nofilter_.size());
   const size_t width_data = width_ * 3 + 1;
-  const size_t height = height_;
-  // 各フィルタタイプの結果を保存する配列
-  std::vector<std::vector<uint8_t>> filtered_results(5);
-  std::vector<size_t> row_filter_scores(5, 0);  
-  for(size_t y = 0; y < height; y++){
-    const size_t row_start = y * width_data;
-    const bool has_prev_row = y > 0;
-    // フィルタ結果配列を初期化
-    for(uint8_t filter_type = 0; filter_type < 5; filter_type++){
-      filtered_results[filter_type].resize(width_data);
-      row_filter_scores[filter_type] = 0;
-    }
-    // 全5種のフィルタについてそれぞれ試す
-    for(uint8_t filter_type = 0; filter_type < 5; filter_type++){
-      // フィルタタイプを設定
-      filtered_results[filter_type][0] = filter_type;
-      switch(filter_type){
-        case 0: // Noneフィルタ
-          for(size_t x = 1; x < width_data; x++){
-            filtered_results[filter_type][x] = image_data_decompressed_nofilter_[row_start + x];
-          }
-          break;          
-        case 1: // Subフィルタ
-          for(size_t x = 1; x < width_data; x++){
-            const uint8_t left = (x >= 3) ? image_data_decompressed_nofilter_[row_start + x - 3] : 0;
-            filtered_results[filter_type][x] = (image_data_decompressed_nofilter_[row_start + x] - left) & 0xFF;
-          }
-          break;
-        case 2: // Upフィルタ
-          for(size_t x = 1; x < width_data; x++){
-            const uint8_t up = has_prev_row ? image_data_decompressed_nofilter_[row_start + x - width_data] : 0;
-            filtered_results[filter_type][x] = (image_data_decompressed_nofilter_[row_start + x] - up) & 0xFF;
-          }
-          break;
-        case 3: // Averageフィルタ
-          for(size_t x = 1; x < width_data; x++){
-            const uint8_t left = (x >= 3) ? image_data_decompressed_nofilter_[row_start + x - 3] : 0;
-            const uint8_t up = has_prev_row ? image_data_decompressed_nofilter_[row_start + x - width_data] : 0;
-            filtered_results[filter_type][x] = (image_data_decompressed_nofilter_[row_start + x] - ((left + up) >> 1)) & 0xFF;
-          }
-          break;
-        case 4: // Paethフィルタ
-          for(size_t x = 1; x < width_data; x++){
-            const uint8_t left = (x >= 3) ? image_data_decompressed_nofilter_[row_start + x - 3] : 0;
-            const uint8_t up = has_prev_row ? image_data_decompressed_nofilter_[row_start + x - width_data] : 0;
-            const uint8_t upleft = (x >= 3 && has_prev_row) ? image_data_decompressed_nofilter_[row_start + x - width_data - 3] : 0;
-            const int p = left + up - upleft;
-            const int pa = std::abs(p - left);
-            const int pb = std::abs(p - up);
-            const int pc = std::abs(p - upleft);
-            const uint8_t predictor = (pa <= pb && pa <= pc) ? left : (pb <= pc ? up : upleft);
-            filtered_results[filter_type][x] = (image_data_decompressed_nofilter_[row_start + x] - predictor) & 0xFF;
-          }
-          break;
-      }      
-      // この行のフィルタスコアを計算
-      for(size_t x = 1; x < width_data; x++){
-        row_filter_scores[filter_type] += std::abs(filtered_results[filter_type][x]);
-      }
-    }    
-    // この行で最もスコアの低い（圧縮に適した）フィルタを選択
-    size_t best_filter = 0;
-    size_t best_score = row_filter_scores[0];
-    for(size_t i = 1; i < 5; i++){
-      if(row_filter_scores[i] < best_score){
-        best_score = row_filter_scores[i];
-        best_filter = i;
-      }
-    }    
-    // 最適なフィルタの結果を最終的な出力にコピー
-    image_data_decompressed_[row_start] = best_filter;
-    std::copy(filtered_results[best_filter].begin(), filtered_results[best_filter].end(), image_data_decompressed_.begin() + row_start);
+  // 各行は上の行のフィルターなしデータしか参照しないので帯ごとに独立
+  utils::parallel_for_bands(height_, 64, [&](const size_t y_begin, const size_t y_end){
+    utils::filter_rows(
+      image_data_decompressed_nofilter_.data(), image_data_decompressed_.data() + y_begin * width_data,
+      width_data, y_begin, y_end, strategy, index_interval_
+    );
+  });
+}
+
+void PNG::set_palette_data(void){
+  // まず色数がpalette_colors_以下かを正確に調べ、超えていれば減色する
+  utils::IndexedImage indexed;
+  if(!utils::exact_palette(image_data_decompressed_nofilter_.data(), width_, height_, palette_colors_, indexed)){
+    indexed = utils::quantize_palette(image_data_decompressed_nofilter_.data(), width_, height_, palette_colors_);
   }
+  const uint8_t bit_depth = utils::palette_bit_depth(indexed.palette.size());
+  const size_t packed_width = (static_cast<size_t>(width_) * bit_depth + 7) / 8 + 1;
+  // パレット画像はフィルターなし(None)が最も縮みやすい
+  image_data_decompressed_.assign(packed_width * height_, 0);
+  utils::parallel_for_bands(height_, 64, [&](const size_t y_begin, const size_t y_end){
+    for(size_t y = y_begin; y < y_end; y++){
+      utils::pack_indices(
+        indexed.indices.data() + y * width_,
+        image_data_decompressed_.data() + y * packed_width + 1,
+        width_, bit_depth
+      );
+    }
+  });
+  ihdr().bit_depth() = bit_depth;
+  ihdr().color_type() = 3;
+  replace_plte(indexed.palette);
 }
 
 void PNG::delete_idat(void){
   chunks_.erase(
     std::remove_if(chunks_.begin(), chunks_.end(),
       [](const Chunk& chunk){
-        return utils::equal_stri(chunk.type_string(), "IDAT");
+        return chunk.type() == TYPE_IDAT || chunk.type() == TYPE_pIdX || chunk.type() == TYPE_pIDX;
       }
     ),
     chunks_.end()
   );
+  index_chunks();
 }
 
 void PNG::insert_idat(void){
@@ -316,7 +1334,7 @@ void PNG::insert_idat(void){
   Chunk idat_chunk;
   idat_chunk.initialize();
   idat_chunk.length() = image_data_compressed_.size();
-  idat_chunk.type() = 0x49444154;  // "IDAT"
+  idat_chunk.type() = TYPE_IDAT;
   idat_chunk.type_string() = "IDAT";
   // IDATデータを設定
   std::vector<char> compressed_data(image_data_compressed_.size());
@@ -334,13 +1352,34 @@ void PNG::insert_idat(void){
   idat_chunk.crc() = utils::calc_crc(crc_data, 0, crc_data.size());
   // チャンクを挿入
   chunks_.insert(chunks_.end() - 1, idat_chunk);
+  if(index_entries_.empty()){
+    index_chunks();
+    return;
+  }
+  // 索引があればIDATの直前にpIdXチャンクを挿入
+  Chunk index_chunk;
+  index_chunk.initialize();
+  index_chunk.type() = TYPE_pIdX;
+  index_chunk.type_string() = "pIdX";
+  pIdX index;
+  index.interval() = index_interval_;
+  index.entries() = index_entries_;
+  const std::vector<char> index_data = index.get();
+  index_chunk.length() = index_data.size();
+  index_chunk.data() = pIdX{index_chunk.length(), index_data};
+  std::vector<char> index_crc_data;
+  index_crc_data.insert(index_crc_data.end(), index_chunk.type_string().begin(), index_chunk.type_string().end());
+  index_crc_data.insert(index_crc_data.end(), index_data.begin(), index_data.end());
+  index_chunk.crc() = utils::calc_crc(index_crc_data, 0, index_crc_data.size());
+  chunks_.insert(chunks_.end() - 2, index_chunk);
+  index_chunks();
 }
 void PNG::insert_text(const std::string& keyword, const std::string& text){
   // 新しいtEXTチャンクを生成
   Chunk text_chunk;
   text_chunk.initialize();
   text_chunk.length() = (keyword.size() + 1 + text.size());
-  text_chunk.type() = 0x74455854;
+  text_chunk.type() = TYPE_tEXT;
   text_chunk.type_string() = "tEXT";
   // tEXTデータを設定
   std::vector<char> data(text_chunk.length());
@@ -355,6 +1394,328 @@ void PNG::insert_text(const std::string& keyword, const std::string& text){
   text_chunk.crc() = utils::calc_crc(crc_data, 0, crc_data.size());
   // チャンクを挿入
   chunks_.insert(chunks_.end() - 1, text_chunk);
+  index_chunks();
+}
+
+void PNG::replace_plte(const std::vector<std::array<uint8_t, 3>>& palette){
+  chunks_.erase(
+    std::remove_if(chunks_.begin(), chunks_.end(),
+      // tRNS・bKGD・hISTは古いパレット(色タイプ)を前提にした内容なので一緒に削除
+      [](const Chunk& chunk){
+        return chunk.type() == TYPE_PLTE || chunk.type() == TYPE_tRNS || chunk.type() == TYPE_bKGD || chunk.type() == TYPE_hIST;
+      }
+    ),
+    chunks_.end()
+  );
+  if(palette.empty()){
+    index_chunks();
+    return;
+  }
+  // 新しいPLTEチャンクを生成
+  Chunk plte_chunk;
+  plte_chunk.initialize();
+  plte_chunk.length() = palette.size() * 3;
+  plte_chunk.type() = TYPE_PLTE;
+  plte_chunk.type_string() = "PLTE";
+  std::vector<char> data;
+  data.reserve(plte_chunk.length());
+  for(const std::array<uint8_t, 3>& color : palette){
+    data.insert(data.end(), color.begin(), color.end());
+  }
+  plte_chunk.data() = PLTE{plte_chunk.length(), data};
+  // CRCを計算
+  std::vector<char> crc_data;
+  crc_data.insert(crc_data.end(), plte_chunk.type_string().begin(), plte_chunk.type_string().end());
+  crc_data.insert(crc_data.end(), data.begin(), data.end());
+  plte_chunk.crc() = utils::calc_crc(crc_data, 0, crc_data.size());
+  // gAMA・cHRM・sRGB・iCCP・sBITなどPLTEより前に置くべきチャンクの後になるよう、最初のIDAT(なければIEND)の直前に挿入
+  const auto position = std::find_if(chunks_.begin(), chunks_.end(),
+    [](const Chunk& chunk){ return chunk.type() == TYPE_IDAT || chunk.type() == TYPE_IEND; }
+  );
+  chunks_.insert(position, plte_chunk);
+  index_chunks();
+}
+
+void PNG::set_index_interval(const uint32_t& interval){
+  index_interval_ = interval;
+}
+
+void PNG::set_palette_colors(const uint16_t& max_colors){
+  if(max_colors > 256){
+    throw std::runtime_error("Palette size must be at most 256");
+  }
+  // APNGのフレームは1つのPLTEを共有するので、フレームごとの減色はできない
+  if(max_colors != 0 && !frame_controls_.empty()){
+    throw std::runtime_error("Palette output is not supported for animated PNG");
+  }
+  palette_colors_ = max_colors;
+}
+
+void PNG::set_optimize(const bool& enabled, const uint32_t& time_budget_ms){
+  optimize_ = enabled;
+  optimize_budget_ms_ = time_budget_ms;
+  for(PNG& frame : frames_){
+    frame.set_optimize(enabled, time_budget_ms);
+  }
+}
+
+void PNG::encode(void){
+  statistics_valid_ = false;
+  encoded_ = true;
+  if(palette_colors_ != 0){
+    set_palette_data();
+  }else{
+    // パレット画像を読み込んだ場合もRGBで書き出す
+    if(ihdr().color_type() == 3){
+      replace_plte({});
+    }
+    ihdr().bit_depth() = 8;
+    ihdr().color_type() = 2;
+    set_filter();
+  }
+  if(optimize_){
+    optimize_compression();
+  }else{
+    compress_data();
+  }
+  delete_idat();
+  insert_idat();
+  insert_text("ImageProcesser", "Tamagosushio");
+}
+
+void PNG::optimize_compression(void){
+  using Clock = std::chrono::steady_clock;
+  const Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(optimize_budget_ms_);
+  const auto expired = [&](){ return optimize_budget_ms_ != 0 && Clock::now() > deadline; };
+  // パレット画像の行はNoneのまま(encode済み)なのでdeflateの設定だけを探す
+  const bool palette = palette_colors_ != 0;
+  const uint32_t segment_rows = palette ? 0 : index_interval_;
+  const size_t width_data = height_ != 0 ? image_data_decompressed_.size() / height_ : 0;
+  const utils::FilterStrategy baseline = palette ? utils::FilterStrategy::NONE : utils::FilterStrategy::ADAPTIVE;
+  struct Trial{
+    utils::FilterStrategy filter;
+    utils::DeflateParams params;
+    size_t size = SIZE_MAX;
+  };
+  // 16行のブロックを画像全体から均等に、合計256KiB程度になるまで取り出して試し圧縮に使う
+  constexpr size_t BLOCK = 16;
+  std::vector<std::pair<size_t, size_t>> blocks;
+  const size_t sample_rows = std::max(BLOCK, (size_t{256} << 10) / std::max<size_t>(width_data, 1));
+  if(height_ <= sample_rows){
+    blocks.push_back({0, height_});
+  }else{
+    const size_t num_blocks = sample_rows / BLOCK;
+    for(size_t i = 0; i < num_blocks; i++){
+      const size_t begin = i * (height_ - BLOCK) / std::max<size_t>(num_blocks - 1, 1);
+      blocks.push_back({begin, begin + BLOCK});
+    }
+  }
+  const auto make_sample = [&](const utils::FilterStrategy filter){
+    std::vector<uint8_t> sample;
+    for(const auto& [begin, end] : blocks){
+      const size_t offset = sample.size();
+      sample.resize(offset + (end - begin) * width_data);
+      if(palette){
+        std::memcpy(sample.data() + offset, image_data_decompressed_.data() + begin * width_data, sample.size() - offset);
+      }else{
+        utils::filter_rows(image_data_decompressed_nofilter_.data(), sample.data() + offset, width_data, begin, end, filter, segment_rows);
+      }
+    }
+    return sample;
+  };
+  const auto sample_size = [&](const std::vector<uint8_t>& sample, const utils::DeflateParams& params){
+    std::vector<uint8_t> out;
+    utils::deflate_rows(sample.data(), width_data, sample.size() / std::max<size_t>(width_data, 1), params, 0, out);
+    return out.size();
+  };
+  // 1段目: 各フィルタ戦略を最大圧縮で試し、上位2つに絞る
+  std::vector<utils::FilterStrategy> filters{baseline};
+  if(!palette){
+    filters = {
+      utils::FilterStrategy::NONE, utils::FilterStrategy::SUB, utils::FilterStrategy::UP, utils::FilterStrategy::AVERAGE,
+      utils::FilterStrategy::PAETH, utils::FilterStrategy::ADAPTIVE, utils::FilterStrategy::ADAPTIVE_SIGNED
+    };
+  }
+  std::vector<std::vector<uint8_t>> samples(filters.size());
+  std::vector<size_t> filter_sizes(filters.size());
+  utils::parallel_for(filters.size(), [&](const size_t i){
+    samples[i] = make_sample(filters[i]);
+    filter_sizes[i] = sample_size(samples[i], utils::DeflateParams{9});
+  });
+  std::vector<size_t> order(filters.size());
+  for(size_t i = 0; i < order.size(); i++) order[i] = i;
+  std::sort(order.begin(), order.end(), [&](const size_t a, const size_t b){ return filter_sizes[a] < filter_sizes[b]; });
+  order.resize(std::min<size_t>(order.size(), 2));
+  // 2段目: 残ったフィルタごとにdeflateの設定を総当たり
+  // RLE・ハフマンのみは一致探索をしない(レベルで変わらない)ので1通りだけ
+  std::vector<std::pair<size_t, Trial>> trials; // (samplesの添字, 設定)
+  for(const size_t i : order){
+    for(const int strategy : {Z_DEFAULT_STRATEGY, Z_FILTERED}){
+      for(int level = 1; level <= 9; level++){
+        for(const int mem_level : {8, 9}){
+          for(const int window_bits : {15, 14, 13}){
+            trials.push_back({i, Trial{filters[i], utils::DeflateParams{level, window_bits, mem_level, strategy}}});
+          }
+        }
+      }
+    }
+    for(const int strategy : {Z_RLE, Z_HUFFMAN_ONLY}){
+      trials.push_back({i, Trial{filters[i], utils::DeflateParams{9, 15, 9, strategy}}});
+    }
+  }
+  utils::parallel_for(trials.size(), [&](const size_t t){
+    // 時間切れ以降の設定は候補から外す
+    if(expired()) return;
+    trials[t].second.size = sample_size(samples[trials[t].first], trials[t].second.params);
+  });
+  std::stable_sort(trials.begin(), trials.end(), [](const auto& a, const auto& b){ return a.second.size < b.second.size; });
+  // 3段目: 上位3つと既定の設定(通常のencodeと同じ)を全体で圧縮し、解凍して一致したうち最小のものを採用
+  std::vector<Trial> finalists{Trial{baseline, utils::DeflateParams{}}};
+  for(size_t t = 0; t < trials.size() && t < 3 && trials[t].second.size != SIZE_MAX; t++){
+    finalists.push_back(trials[t].second);
+  }
+  std::vector<utils::FilterStrategy> final_filters;
+  for(const Trial& trial : finalists){
+    if(std::find(final_filters.begin(), final_filters.end(), trial.filter) == final_filters.end()){
+      final_filters.push_back(trial.filter);
+    }
+  }
+  // 既定のフィルタの結果は image_data_decompressed_ にある
+  std::vector<std::vector<uint8_t>> filtered(final_filters.size());
+  utils::parallel_for(final_filters.size(), [&](const size_t i){
+    if(final_filters[i] == baseline) return;
+    filtered[i].resize(image_data_decompressed_.size());
+    utils::filter_rows(image_data_decompressed_nofilter_.data(), filtered[i].data(), width_data, 0, height_, final_filters[i], segment_rows);
+  });
+  const auto filtered_data = [&](const utils::FilterStrategy filter) -> const std::vector<uint8_t>& {
+    const size_t i = std::find(final_filters.begin(), final_filters.end(), filter) - final_filters.begin();
+    return filter == baseline ? image_data_decompressed_ : filtered[i];
+  };
+  std::vector<std::vector<uint8_t>> compressed(finalists.size());
+  std::vector<std::vector<std::pair<uint32_t, uint32_t>>> entries(finalists.size());
+  utils::parallel_for(finalists.size(), [&](const size_t i){
+    const std::vector<uint8_t>& data = filtered_data(finalists[i].filter);
+    utils::deflate_rows(data.data(), width_data, height_, finalists[i].params, segment_rows, compressed[i], &entries[i]);
+    finalists[i].size = compressed[i].size();
+  });
+  std::vector<size_t> ranking(finalists.size());
+  for(size_t i = 0; i < ranking.size(); i++) ranking[i] = i;
+  std::stable_sort(ranking.begin(), ranking.end(), [&](const size_t a, const size_t b){ return finalists[a].size < finalists[b].size; });
+  for(const size_t i : ranking){
+    const std::vector<uint8_t>& data = filtered_data(finalists[i].filter);
+    if(!utils::inflate_equals(compressed[i], data)) continue;
+    if(finalists[i].filter != baseline){
+      image_data_decompressed_ = data;
+    }
+    image_data_compressed_ = std::move(compressed[i]);
+    index_entries_ = segment_rows != 0 ? std::move(entries[i]) : std::vector<std::pair<uint32_t, uint32_t>>{};
+    return;
+  }
+  throw std::runtime_error("deflate failed");
+}
+
+template<typename T>
+Chunk PNG::make_chunk(const uint32_t type, const std::string& type_string, const std::vector<char>& data){
+  Chunk chunk;
+  chunk.initialize();
+  chunk.length() = data.size();
+  chunk.type() = type;
+  chunk.type_string() = type_string;
+  chunk.data() = T{chunk.length(), data};
+  std::vector<char> crc_data(type_string.begin(), type_string.end());
+  crc_data.insert(crc_data.end(), data.begin(), data.end());
+  chunk.crc() = utils::calc_crc(crc_data, 0, crc_data.size());
+  return chunk;
+}
+
+void PNG::encode_animation(void){
+  chunks_.erase(
+    std::remove_if(chunks_.begin(), chunks_.end(),
+      [](const Chunk& chunk){
+        return chunk.type() == TYPE_acTL || chunk.type() == TYPE_fcTL || chunk.type() == TYPE_fdAT;
+      }
+    ),
+    chunks_.end()
+  );
+  index_chunks();
+  utils::parallel_for(frames_.size(), [&](const size_t i){
+    if(!frames_[i].encoded_) frames_[i].encode();
+  });
+  // 各フレームをキャンバス全面・上書き合成・表示後そのままで書き出すので、どのフレームも前後に依存しない
+  uint32_t sequence_number = 0;
+  const auto control_chunk = [&](fcTL& control){
+    control.sequence_number() = sequence_number++;
+    control.width() = width_;
+    control.height() = height_;
+    control.x_offset() = 0;
+    control.y_offset() = 0;
+    control.dispose_op() = fcTL::DISPOSE_NONE;
+    control.blend_op() = fcTL::BLEND_SOURCE;
+    return make_chunk<fcTL>(TYPE_fcTL, "fcTL", control.get());
+  };
+  acTL animation_control;
+  animation_control.num_frames() = frame_controls_.size();
+  animation_control.num_plays() = num_plays_;
+  // acTL(と既定画像を兼ねる先頭フレームのfcTL)はIDATの前に置く
+  std::vector<Chunk> head{make_chunk<acTL>(TYPE_acTL, "acTL", animation_control.get())};
+  if(default_is_frame_){
+    head.push_back(control_chunk(frame_controls_[0]));
+  }
+  chunks_.insert(chunks_.begin() + idat_indices_.front(), head.begin(), head.end());
+  // 残りのフレームはIENDの直前にfcTL・fdATの順で並べる
+  const size_t first = default_is_frame_ ? 1 : 0;
+  std::vector<Chunk> tail;
+  for(size_t i = 0; i < frames_.size(); i++){
+    tail.push_back(control_chunk(frame_controls_[first + i]));
+    std::vector<char> data = utils::int2vecchar(sequence_number++);
+    data.insert(data.end(), frames_[i].image_data_compressed_.begin(), frames_[i].image_data_compressed_.end());
+    tail.push_back(make_chunk<fdAT>(TYPE_fdAT, "fdAT", data));
+  }
+  chunks_.insert(chunks_.end() - 1, tail.begin(), tail.end());
+  index_chunks();
+}
+
+template<typename F>
+void PNG::apply_to_frames(F&& operation){
+  if(frames_.empty()) return;
+  // フレームごとに並列化し、各フレーム内の処理は入れ子のparallel_forとして順に実行される
+  utils::parallel_for(frames_.size(), [&](const size_t i){
+    operation(frames_[i]);
+  });
+  encode_animation();
+}
+
+PNG PNG::frame(const size_t& index){
+  if(index >= frame_controls_.size()){
+    throw std::runtime_error("Frame index out of range");
+  }
+  // 既定画像を兼ねる先頭フレームは、アニメーションのチャンクを除いた静止画として作り直す
+  if(default_is_frame_ && index == 0){
+    unset_filter();
+    PNG res = derive(std::vector<uint8_t>(image_data_decompressed_nofilter_), height_, width_);
+    res.encode();
+    return res;
+  }
+  PNG& res = frames_[default_is_frame_ ? index - 1 : index];
+  if(!res.encoded_){
+    res.encode();
+  }
+  return res;
+}
+
+std::pair<uint16_t, uint16_t> PNG::frame_delay(const size_t& index) const{
+  if(index >= frame_controls_.size()){
+    throw std::runtime_error("Frame index out of range");
+  }
+  return {frame_controls_[index].delay_num(), frame_controls_[index].delay_den()};
+}
+
+void PNG::resize_header(const uint32_t height, const uint32_t width){
+  height_ = height;
+  width_ = width;
+  // IHDRチャンクのデータを変更
+  ihdr().height() = height;
+  ihdr().width() = width;
 }
 
 void PNG::write(const std::string& path) const{
@@ -387,6 +1748,11 @@ void PNG::write(const std::string& path) const{
     std::vector<char> crc_bytes = utils::int2vecchar(crc);
     ofs.write(crc_bytes.data(), 4);
   }
+  // ディスクが一杯などで書き切れなかった場合に途中までのファイルを正常扱いしない
+  ofs.close();
+  if(!ofs){
+    throw std::runtime_error("Failed to write output file");
+  }
 }
 
 void PNG::debug() const{
@@ -403,112 +1769,581 @@ void PNG::debug() const{
 }
 
 void PNG::reverse_color(){
+  apply(PointwiseOps{}.invert());
+}
+
+void PNG::apply(const PointwiseOps& ops){
   unset_filter();
-  // 色反転処理
+  const std::vector<PointwiseOps::Stage>& stages = ops.stages();
   const size_t width_data = width_ * 3 + 1;
-  for(size_t i = 0; i < image_data_decompressed_.size(); i++){
-    if(i % width_data == 0) image_data_decompressed_[i] = 0x00;
-    else image_data_decompressed_nofilter_[i] = ~image_data_decompressed_nofilter_[i];
+  // 行ごとにフィルタタイプの1バイトを飛ばし、全段を1パスで適用する
+  utils::parallel_for_bands(height_, 64, [&](const size_t y_begin, const size_t y_end){
+    for(size_t y = y_begin; y < y_end; y++){
+      utils::apply_pointwise_row(stages, image_data_decompressed_nofilter_.data() + y * width_data + 1, width_);
+    }
+  });
+  encode();
+  apply_to_frames([&](PNG& frame){ frame.apply(ops); });
+}
+
+void PNG::auto_levels(const double& clip){
+  if(clip < 0.0 || clip >= 0.5){
+    throw std::runtime_error("Clip ratio must be in [0, 0.5)");
   }
-  set_filter();
-  compress_data();
-  delete_idat();
-  insert_idat();
-  insert_text("ImageProcesser", "Tamagosushio");
+  // 集計済みのヒストグラムだけから入力の黒・白レベルを決める
+  const Statistics& stats = statistics();
+  const uint64_t limit = static_cast<uint64_t>(stats.num_pixels * clip);
+  PointwiseOps ops;
+  for(int c = 0; c < 3; c++){
+    const std::array<uint64_t, 256>& histogram = stats.histogram[c];
+    int lo = 0, hi = 255;
+    uint64_t below = 0, above = 0;
+    while(lo < 255 && below + histogram[lo] <= limit) below += histogram[lo++];
+    while(hi > 0 && above + histogram[hi] <= limit) above += histogram[hi--];
+    // 単色のチャネルと、すでに全域を使っているチャネルはそのまま
+    if(hi <= lo || (lo == 0 && hi == 255)) continue;
+    ops.levels(static_cast<uint8_t>(lo), static_cast<uint8_t>(hi), 1.0, 0, 255, c);
+  }
+  // フレームにも既定画像と同じ変換をかけ、フレーム間でちらつかないようにする
+  apply(ops);
 }
 
 void PNG::resize_data(const double& scale_height, const double& scale_width){
   unset_filter();
   const uint32_t height_resized = static_cast<uint32_t>(height_ * scale_height);
   const uint32_t width_resized = static_cast<uint32_t>(width_ * scale_width);
-  const size_t row_size = width_resized * 3 + 1;
-  std::vector<uint8_t> image_data_resized(height_resized * row_size);
-    // 出力画像の各ピクセルに対して処理
-  for(uint32_t y = 0; y < height_resized; y++) {
-    // フィルタタイプを設定（0: None）
-    image_data_resized[y * row_size] = 0;
-    for(uint32_t x = 0; x < width_resized; x++) {
-      // 元画像での対応する座標範囲を計算
-      double src_x_start = x / scale_width;
-      double src_y_start = y / scale_height;
-      double src_x_end = (x + 1) / scale_width;
-      double src_y_end = (y + 1) / scale_height;
-      // 元画像のピクセル範囲を取得
-      uint32_t src_x0 = static_cast<uint32_t>(src_x_start);
-      uint32_t src_y0 = static_cast<uint32_t>(src_y_start);
-      uint32_t src_x1 = std::min(static_cast<uint32_t>(src_x_end) + 1, width_);
-      uint32_t src_y1 = std::min(static_cast<uint32_t>(src_y_end) + 1, height_);
-      // RGB各チャンネルに対して重み付け平均を計算
-      for(int c = 0; c < 3; c++) {
-        double weighted_sum = 0.0;
-        double total_weight = 0.0;
-        // 重なっている元画像のピクセルを処理
-        for(uint32_t src_y = src_y0; src_y < src_y1; src_y++) {
-          for(uint32_t src_x = src_x0; src_x < src_x1; src_x++) {
-            // 重なりの面積を計算
-            double overlap_x_start = std::max(src_x_start, static_cast<double>(src_x));
-            double overlap_x_end = std::min(src_x_end, static_cast<double>(src_x + 1));
-            double overlap_y_start = std::max(src_y_start, static_cast<double>(src_y));
-            double overlap_y_end = std::min(src_y_end, static_cast<double>(src_y + 1));
-            double overlap_area = (overlap_x_end - overlap_x_start) * (overlap_y_end - overlap_y_start);
-            // 元画像のピクセル値を取得（フィルタなしのデータから）
-            size_t src_idx = src_y * (width_ * 3 + 1) + src_x * 3 + c + 1;
-            uint8_t src_value = image_data_decompressed_nofilter_[src_idx];
-            weighted_sum += src_value * overlap_area;
-            total_weight += overlap_area;
-          }
+  std::vector<uint8_t> image_data_resized = utils::resample_area(
+    image_data_decompressed_nofilter_, height_, width_, scale_height, scale_width, height_resized, width_resized
+  );
+  // リサイズしたデータを元のデータにコピー
+  image_data_decompressed_nofilter_ = std::move(image_data_resized);
+  resize_header(height_resized, width_resized);
+  encode();
+  apply_to_frames([&](PNG& frame){ frame.resize_data(scale_height, scale_width); });
+}
+
+void PNG::check_blit(const BlitOp& op) const{
+  const Rect& src = op.src;
+  if(src.height == 0 || src.width == 0
+     || static_cast<uint64_t>(src.y) + src.height > height_ || static_cast<uint64_t>(src.x) + src.width > width_
+     || static_cast<uint64_t>(op.dst_y) + src.height > height_ || static_cast<uint64_t>(op.dst_x) + src.width > width_){
+    throw std::runtime_error("Blit region out of range");
+  }
+}
+
+void PNG::blit_rows(const std::vector<BlitOp>& ops){
+  // 呼び出し側は続けてencodeするので、空でもフィルター解除済みデータを用意しておく
+  unset_filter();
+  if(ops.empty()) return;
+  const size_t width_data = width_ * 3 + 1;
+  uint8_t* image = image_data_decompressed_nofilter_.data();
+  if(ops.size() == 1){
+    // 1つだけなら作業領域なしでその場で動かす。下へ動かすときは下の行から写して上書き前に読む
+    const BlitOp& op = ops[0];
+    const size_t row_bytes = op.src.width * 3;
+    const bool bottom_up = op.dst_y > op.src.y;
+    for(size_t i = 0; i < op.src.height; i++){
+      const size_t h = bottom_up ? op.src.height - 1 - i : i;
+      std::memmove(
+        image + (op.dst_y + h) * width_data + 1 + op.dst_x * 3,
+        image + (op.src.y + h) * width_data + 1 + op.src.x * 3,
+        row_bytes
+      );
+    }
+    return;
+  }
+  // 複数なら転送元を先に退避する。転送元の合計が画像より小さければ矩形ごとに詰めて、そうでなければ画像ごと写す
+  size_t source_bytes = 0;
+  for(const BlitOp& op : ops) source_bytes += static_cast<size_t>(op.src.height) * op.src.width * 3;
+  const bool pack_sources = source_bytes < image_data_decompressed_nofilter_.size();
+  std::vector<uint8_t> sources(pack_sources ? source_bytes : image_data_decompressed_nofilter_.size());
+  std::vector<size_t> offsets(ops.size(), 0);
+  if(pack_sources){
+    size_t offset = 0;
+    for(size_t i = 0; i < ops.size(); i++){
+      const BlitOp& op = ops[i];
+      const size_t row_bytes = op.src.width * 3;
+      offsets[i] = offset;
+      for(size_t h = 0; h < op.src.height; h++){
+        std::memcpy(sources.data() + offset, image + (op.src.y + h) * width_data + 1 + op.src.x * 3, row_bytes);
+        offset += row_bytes;
+      }
+    }
+  }else{
+    std::memcpy(sources.data(), image, sources.size());
+  }
+  const auto source_row = [&](const size_t i, const size_t h){
+    const BlitOp& op = ops[i];
+    return pack_sources ? sources.data() + offsets[i] + h * op.src.width * 3
+                        : sources.data() + (op.src.y + h) * width_data + 1 + op.src.x * 3;
+  };
+  // 転送先を上から1パスで走査し、各行にかかる矩形を指定順に書く。行どうしは独立なので帯ごとに並列
+  utils::parallel_for_bands(height_, 64, [&](const size_t y_begin, const size_t y_end){
+    std::vector<size_t> active;
+    for(size_t i = 0; i < ops.size(); i++){
+      if(ops[i].dst_y < y_end && ops[i].dst_y + ops[i].src.height > y_begin) active.push_back(i);
+    }
+    for(size_t y = y_begin; y < y_end; y++){
+      uint8_t* row = image + y * width_data + 1;
+      for(const size_t i : active){
+        const BlitOp& op = ops[i];
+        if(y < op.dst_y || y >= op.dst_y + op.src.height) continue;
+        std::memcpy(row + op.dst_x * 3, source_row(i, y - op.dst_y), op.src.width * 3);
+      }
+    }
+  });
+}
+
+void PNG::blit(const Rect& src, const uint32_t& dst_y, const uint32_t& dst_x){
+  const BlitOp op{src, dst_y, dst_x};
+  check_blit(op);
+  blit_rows({op});
+  encode();
+  apply_to_frames([&](PNG& frame){ frame.blit(src, dst_y, dst_x); });
+}
+
+void PNG::blit(const std::vector<BlitOp>& ops){
+  for(const BlitOp& op : ops) check_blit(op);
+  blit_rows(ops);
+  encode();
+  apply_to_frames([&](PNG& frame){ frame.blit(ops); });
+}
+
+void PNG::collapse(const int& shuffle_num, const uint64_t& seed){
+  // mt19937_64の出力列は規格で決まっているので、同じseedならどの環境でも同じ結果になる
+  std::mt19937_64 rng(seed);
+  const auto rand_int = [&](const uint32_t min, const uint32_t max){
+    return static_cast<uint32_t>(min + rng() % (static_cast<uint64_t>(max) - min + 1));
+  };
+  // 貼り付けはすべて元の画像から切り取る
+  std::vector<BlitOp> ops(std::max(shuffle_num, 0));
+  for(BlitOp& op : ops){
+    op.src.height = rand_int(1, height_);
+    op.src.width = rand_int(1, width_);
+    op.src.y = rand_int(0, height_ - op.src.height);
+    op.src.x = rand_int(0, width_ - op.src.width);
+    op.dst_y = rand_int(0, height_ - op.src.height);
+    op.dst_x = rand_int(0, width_ - op.src.width);
+  }
+  blit_rows(ops);
+  encode();
+  // 全フレームに同じ貼り付けを施す
+  apply_to_frames([&](PNG& frame){ frame.collapse(shuffle_num, seed); });
+}
+
+void PNG::transpose_tiled(const bool reverse_x, const bool reverse_y){
+  unset_filter();
+  // 出力は(元の幅)×(元の高さ)。元の(y, x)を出力の(reverse_x ? w-1-x : x, reverse_y ? h-1-y : y)に置く
+  constexpr size_t TILE = 32; // 読み書き両方のタイルがL1に収まる大きさ
+  const size_t src_width_data = width_ * 3 + 1;
+  const size_t dst_width_data = height_ * 3 + 1;
+  const uint8_t* src = image_data_decompressed_nofilter_.data();
+  std::vector<uint8_t> transposed(static_cast<size_t>(width_) * dst_width_data);
+  uint8_t* dst = transposed.data();
+  // 出力の行帯(=元の列帯)ごとにスレッドへ割り振る
+  utils::parallel_for_bands(width_, TILE, [&](const size_t x_begin, const size_t x_end){
+    for(size_t y_begin = 0; y_begin < height_; y_begin += TILE){
+      const size_t y_end = std::min<size_t>(y_begin + TILE, height_);
+      for(size_t x = x_begin; x < x_end; x++){
+        const size_t dst_row = reverse_x ? width_ - 1 - x : x;
+        uint8_t* dst_row_ptr = dst + dst_row * dst_width_data + 1;
+        for(size_t y = y_begin; y < y_end; y++){
+          const size_t dst_col = reverse_y ? height_ - 1 - y : y;
+          std::memcpy(dst_row_ptr + dst_col * 3, src + y * src_width_data + 1 + x * 3, 3);
         }
-        // 重み付け平均を計算して出力
-        size_t dst_idx = y * row_size + x * 3 + c + 1;
-        image_data_resized[dst_idx] = static_cast<uint8_t>(weighted_sum / total_weight);
       }
     }
+  });
+  image_data_decompressed_nofilter_ = std::move(transposed);
+  resize_header(width_, height_);
+}
+
+void PNG::rotate(const int& degree){
+  const int normalized = ((degree % 360) + 360) % 360;
+  if(normalized % 90 != 0){
+    throw std::runtime_error("Rotation degree must be a multiple of 90");
   }
-  // リサイズしたデータを元のデータにコピー
-  image_data_decompressed_nofilter_ = std::move(image_data_resized);
-  height_ = height_resized;
-  width_ = width_resized;
-  // IHDRチャンクのデータを変更
-  std::get<IHDR>(chunks_[0].data()).height() = height_resized;
-  std::get<IHDR>(chunks_[0].data()).width() = width_resized;
-  set_filter();
-  compress_data();
-  delete_idat();
-  insert_idat();
-  insert_text("ImageProcesser", "Tamagosushio");
+  if(normalized == 0) return;
+  if(normalized == 90){
+    transpose_tiled(false, true);
+  }else if(normalized == 270){
+    transpose_tiled(true, false);
+  }else{
+    unset_filter();
+    // 180度回転は行の順序と行内のピクセル順序を両方反転
+    const size_t width_data = width_ * 3 + 1;
+    std::vector<uint8_t> rotated(image_data_decompressed_nofilter_.size());
+    utils::parallel_for_bands(height_, 64, [&](const size_t y_begin, const size_t y_end){
+      for(size_t y = y_begin; y < y_end; y++){
+        utils::reverse_pixels(
+          image_data_decompressed_nofilter_.data() + (height_ - 1 - y) * width_data + 1,
+          rotated.data() + y * width_data + 1,
+          width_
+        );
+      }
+    });
+    image_data_decompressed_nofilter_ = std::move(rotated);
+  }
+  encode();
+  apply_to_frames([&](PNG& frame){ frame.rotate(degree); });
 }
 
-void PNG::collapse(const int& shuffle_num){
+void PNG::flip_horizontal(void){
   unset_filter();
+  const size_t width_data = width_ * 3 + 1;
+  std::vector<uint8_t> flipped(image_data_decompressed_nofilter_.size());
+  utils::parallel_for_bands(height_, 64, [&](const size_t y_begin, const size_t y_end){
+    for(size_t y = y_begin; y < y_end; y++){
+      utils::reverse_pixels(
+        image_data_decompressed_nofilter_.data() + y * width_data + 1,
+        flipped.data() + y * width_data + 1,
+        width_
+      );
+    }
+  });
+  image_data_decompressed_nofilter_ = std::move(flipped);
+  encode();
+  apply_to_frames([&](PNG& frame){ frame.flip_horizontal(); });
+}
 
-  std::vector<uint8_t> collapsed = image_data_decompressed_nofilter_;
+void PNG::flip_vertical(void){
+  unset_filter();
   const size_t width_data = width_ * 3 + 1;
-  for(int _=0; _ < shuffle_num; _++){
-    std::pair<int,int> clip_size{
-      rand_int(1, height_), rand_int(1, width_)
-    };
-    std::pair<int,int> clip_pos{
-      rand_int(0, height_ - clip_size.first), rand_int(0, width_ - clip_size.second)
-    };
-    std::pair<int,int> paste_pos{
-      rand_int(0, height_ - clip_size.first), rand_int(0, width_ - clip_size.second)
+  std::vector<uint8_t> flipped(image_data_decompressed_nofilter_.size());
+  utils::parallel_for_bands(height_, 64, [&](const size_t y_begin, const size_t y_end){
+    for(size_t y = y_begin; y < y_end; y++){
+      std::memcpy(
+        flipped.data() + y * width_data,
+        image_data_decompressed_nofilter_.data() + (height_ - 1 - y) * width_data,
+        width_data
+      );
+    }
+  });
+  image_data_decompressed_nofilter_ = std::move(flipped);
+  encode();
+  apply_to_frames([&](PNG& frame){ frame.flip_vertical(); });
+}
+
+void PNG::transpose(void){
+  transpose_tiled(false, false);
+  encode();
+  apply_to_frames([&](PNG& frame){ frame.transpose(); });
+}
+
+void PNG::crop(const uint32_t& y, const uint32_t& x, const uint32_t& height, const uint32_t& width){
+  if(height == 0 || width == 0 || y > height_ || x > width_ || height > height_ - y || width > width_ - x){
+    throw std::runtime_error("Crop region is out of range");
+  }
+  // フィルター未解除なら切り抜き範囲の最終行までだけ解除する(それより下の行は参照されない)
+  if(!nofilter_valid_){
+    image_data_decompressed_nofilter_.resize(image_data_decompressed_.size());
+    unset_filter_rows(0, y + height);
+  }
+  const size_t src_width_data = width_ * 3 + 1;
+  const size_t dst_width_data = static_cast<size_t>(width) * 3 + 1;
+  std::vector<uint8_t> cropped(height * dst_width_data);
+  utils::parallel_for_bands(height, 64, [&](const size_t y_begin, const size_t y_end){
+    for(size_t h = y_begin; h < y_end; h++){
+      std::memcpy(
+        cropped.data() + h * dst_width_data + 1,
+        image_data_decompressed_nofilter_.data() + (y + h) * src_width_data + 1 + x * 3,
+        width * 3
+      );
+    }
+  });
+  image_data_decompressed_nofilter_ = std::move(cropped);
+  nofilter_valid_ = true;
+  resize_header(height, width);
+  encode();
+  apply_to_frames([&](PNG& frame){ frame.crop(y, x, height, width); });
+}
+
+void PNG::convolve_fixed(const std::vector<int32_t>& kernel_x, const std::vector<int32_t>& kernel_y){
+  unset_filter();
+  const size_t width_data = width_ * 3 + 1;
+  const size_t row_bytes = width_ * 3;
+  const size_t radius_x = kernel_x.size() / 2;
+  const size_t radius_y = kernel_y.size() / 2;
+  const size_t band = std::max<size_t>(64, radius_y * 4);
+  const uint8_t* src = image_data_decompressed_nofilter_.data();
+  std::vector<uint8_t> convolved(image_data_decompressed_nofilter_.size());
+  // 行帯ごとに上下radius_y行のハローを含めて横方向を計算し、その帯の中で縦方向を計算する
+  utils::parallel_for_bands(height_, band, [&](const size_t y_begin, const size_t y_end){
+    const size_t halo_begin = y_begin - std::min(y_begin, radius_y);
+    const size_t halo_end = std::min<size_t>(y_end + radius_y, height_);
+    std::vector<uint8_t> padded((width_ + radius_x * 2) * 3);
+    std::vector<int32_t> acc(row_bytes);
+    std::vector<int16_t> horizontal((halo_end - halo_begin) * row_bytes);
+    for(size_t y = halo_begin; y < halo_end; y++){
+      // 左右端は端のピクセルを複製
+      const uint8_t* row = src + y * width_data + 1;
+      for(size_t x = 0; x < radius_x; x++){
+        std::memcpy(padded.data() + x * 3, row, 3);
+        std::memcpy(padded.data() + (radius_x + width_ + x) * 3, row + row_bytes - 3, 3);
+      }
+      std::memcpy(padded.data() + radius_x * 3, row, row_bytes);
+      std::fill(acc.begin(), acc.end(), 0);
+      for(size_t k = 0; k < kernel_x.size(); k++){
+        const int32_t weight = kernel_x[k];
+        const uint8_t* tap = padded.data() + k * 3;
+        for(size_t i = 0; i < row_bytes; i++) acc[i] += weight * tap[i];
+      }
+      int16_t* out = horizontal.data() + (y - halo_begin) * row_bytes;
+      for(size_t i = 0; i < row_bytes; i++){
+        out[i] = static_cast<int16_t>(std::clamp((acc[i] + (1 << 13)) >> 14, -32768, 32767));
+      }
+    }
+    for(size_t y = y_begin; y < y_end; y++){
+      std::fill(acc.begin(), acc.end(), 0);
+      for(size_t k = 0; k < kernel_y.size(); k++){
+        // 上下端は端の行を複製
+        const size_t tap_y = std::clamp<ptrdiff_t>(
+          static_cast<ptrdiff_t>(y + k) - static_cast<ptrdiff_t>(radius_y), 0, static_cast<ptrdiff_t>(height_) - 1
+        );
+        const int32_t weight = kernel_y[k];
+        const int16_t* tap = horizontal.data() + (tap_y - halo_begin) * row_bytes;
+        for(size_t i = 0; i < row_bytes; i++) acc[i] += weight * tap[i];
+      }
+      uint8_t* out = convolved.data() + y * width_data + 1;
+      for(size_t i = 0; i < row_bytes; i++){
+        out[i] = static_cast<uint8_t>(std::clamp((acc[i] + (1 << 13)) >> 14, 0, 255));
+      }
+    }
+  });
+  image_data_decompressed_nofilter_ = std::move(convolved);
+}
+
+void PNG::box_blur_pass(const uint32_t radius){
+  unset_filter();
+  if(radius == 0) return;
+  const size_t width_data = width_ * 3 + 1;
+  const size_t row_bytes = width_ * 3;
+  const size_t band = std::max<size_t>(64, static_cast<size_t>(radius) * 4);
+  const ptrdiff_t last_x = static_cast<ptrdiff_t>(width_) - 1;
+  const ptrdiff_t last_y = static_cast<ptrdiff_t>(height_) - 1;
+  const ptrdiff_t r = radius;
+  // 窓内の和に掛けて22ビット右シフトすると平均になる係数
+  // 係数を四捨五入しているので、半径が大きいと全画素255の窓で256になりうる。255で飽和させる
+  const uint32_t multiplier = static_cast<uint32_t>(std::lround(static_cast<double>(1 << 22) / (radius * 2 + 1)));
+  const auto average = [multiplier](const uint32_t sum){
+    return static_cast<uint8_t>(std::min<uint32_t>((sum * multiplier + (1 << 21)) >> 22, 255));
+  };
+  const uint8_t* src = image_data_decompressed_nofilter_.data();
+  std::vector<uint8_t> blurred(image_data_decompressed_nofilter_.size());
+  // 窓の和を1画素ごとに出入りさせて更新するので、半径によらず1画素あたりO(1)
+  utils::parallel_for_bands(height_, band, [&](const size_t y_begin, const size_t y_end){
+    const size_t halo_begin = y_begin - std::min<size_t>(y_begin, radius);
+    const size_t halo_end = std::min<size_t>(y_end + radius + 1, height_); // 窓から出し入れする1行先まで
+    std::vector<uint8_t> horizontal((halo_end - halo_begin) * row_bytes);
+    for(size_t y = halo_begin; y < halo_end; y++){
+      const uint8_t* row = src + y * width_data + 1;
+      uint8_t* out = horizontal.data() + (y - halo_begin) * row_bytes;
+      for(size_t c = 0; c < 3; c++){
+        uint32_t sum = 0;
+        for(ptrdiff_t x = -r; x <= r; x++) sum += row[std::clamp<ptrdiff_t>(x, 0, last_x) * 3 + c];
+        for(ptrdiff_t x = 0; x <= last_x; x++){
+          out[x * 3 + c] = average(sum);
+          sum += row[std::min(x + r + 1, last_x) * 3 + c];
+          sum -= row[std::max<ptrdiff_t>(x - r, 0) * 3 + c];
+        }
+      }
+    }
+    // 縦方向は行全体の和の配列を出し入れする(行方向に連続なのでベクトル化される)
+    const auto halo_row = [&](const ptrdiff_t y){
+      return horizontal.data() + (std::clamp<ptrdiff_t>(y, 0, last_y) - halo_begin) * row_bytes;
     };
-    for(int h = 0; h < clip_size.first; h++){
-      for(int w = 0; w < clip_size.second*3; w++){
-        collapsed[(h + paste_pos.first) * width_data + (w + paste_pos.second)]
-          = image_data_decompressed_nofilter_[(h + clip_pos.first) * width_data + (w + clip_pos.second)];
+    std::vector<uint32_t> sums(row_bytes, 0);
+    for(ptrdiff_t y = static_cast<ptrdiff_t>(y_begin) - r; y <= static_cast<ptrdiff_t>(y_begin) + r; y++){
+      const uint8_t* row = halo_row(y);
+      for(size_t i = 0; i < row_bytes; i++) sums[i] += row[i];
+    }
+    for(size_t y = y_begin; y < y_end; y++){
+      uint8_t* out = blurred.data() + y * width_data + 1;
+      for(size_t i = 0; i < row_bytes; i++){
+        out[i] = average(sums[i]);
       }
+      const uint8_t* row_in = halo_row(static_cast<ptrdiff_t>(y) + r + 1);
+      const uint8_t* row_out = halo_row(static_cast<ptrdiff_t>(y) - r);
+      for(size_t i = 0; i < row_bytes; i++) sums[i] += row_in[i] - row_out[i];
+    }
+  });
+  image_data_decompressed_nofilter_ = std::move(blurred);
+}
+
+void PNG::gaussian_blur_pass(const double sigma){
+  if(sigma <= 0.0){
+    unset_filter();
+    return;
+  }
+  const size_t radius = static_cast<size_t>(std::ceil(sigma * 3.0));
+  if(radius > 6){
+    // 半径が大きいときは3回の箱型ぼかしで近似する
+    for(const uint32_t box_radius : utils::gaussian_box_radii(sigma)){
+      box_blur_pass(box_radius);
     }
+    return;
+  }
+  std::vector<double> kernel(radius * 2 + 1);
+  double sum = 0.0;
+  for(size_t i = 0; i < kernel.size(); i++){
+    const double d = static_cast<double>(i) - static_cast<double>(radius);
+    kernel[i] = std::exp(-d * d / (2.0 * sigma * sigma));
+    sum += kernel[i];
   }
-  image_data_decompressed_nofilter_ = std::move(collapsed);
+  for(double& weight : kernel) weight /= sum;
+  const std::vector<int32_t> kernel_fixed = utils::quantize_kernel(kernel);
+  convolve_fixed(kernel_fixed, kernel_fixed);
+}
 
-  set_filter();
-  compress_data();
-  delete_idat();
-  insert_idat();
-  insert_text("ImageProcesser", "Tamagosushio");
+void PNG::convolve(const std::vector<double>& kernel_x, const std::vector<double>& kernel_y){
+  convolve_fixed(utils::quantize_kernel(kernel_x), utils::quantize_kernel(kernel_y));
+  encode();
+  apply_to_frames([&](PNG& frame){ frame.convolve(kernel_x, kernel_y); });
 }
 
-} // namespace png
+void PNG::box_blur(const uint32_t& radius){
+  box_blur_pass(radius);
+  encode();
+  apply_to_frames([&](PNG& frame){ frame.box_blur(radius); });
+}
+
+void PNG::gaussian_blur(const double& sigma){
+  gaussian_blur_pass(sigma);
+  encode();
+  apply_to_frames([&](PNG& frame){ frame.gaussian_blur(sigma); });
+}
+
+void PNG::unsharp_mask(const double& sigma, const double& amount, const uint8_t& threshold){
+  unset_filter();
+  const std::vector<uint8_t> original = image_data_decompressed_nofilter_;
+  gaussian_blur_pass(sigma);
+  // 元画像 + amount × (元画像 - ぼかし画像)。差がthreshold未満の画素は元のまま
+  const size_t width_data = width_ * 3 + 1;
+  const int32_t amount_fixed = static_cast<int32_t>(std::lround(amount * 256.0));
+  utils::parallel_for_bands(height_, 64, [&](const size_t y_begin, const size_t y_end){
+    for(size_t y = y_begin; y < y_end; y++){
+      const uint8_t* orig = original.data() + y * width_data + 1;
+      uint8_t* out = image_data_decompressed_nofilter_.data() + y * width_data + 1;
+      for(size_t i = 0; i < width_ * 3; i++){
+        const int32_t diff = static_cast<int32_t>(orig[i]) - out[i];
+        const int32_t sharpened = orig[i] + ((amount_fixed * diff + 128) >> 8);
+        out[i] = (std::abs(diff) < threshold) ? orig[i] : static_cast<uint8_t>(std::clamp(sharpened, 0, 255));
+      }
+    }
+  });
+  encode();
+  apply_to_frames([&](PNG& frame){ frame.unsharp_mask(sigma, amount, threshold); });
+}
+
+PNG PNG::derive(std::vector<uint8_t>&& image_data_nofilter, const uint32_t height, const uint32_t width) const{
+  PNG res;
+  std::copy_if(chunks_.begin(), chunks_.end(), std::back_inserter(res.chunks_), [](const Chunk& chunk){
+    switch(chunk.type()){
+      case TYPE_IDAT: case TYPE_pIdX: case TYPE_pIDX: case TYPE_acTL: case TYPE_fcTL: case TYPE_fdAT: return false;
+      default: return true;
+    }
+  });
+  res.index_chunks();
+  res.index_interval_ = index_interval_;
+  res.palette_colors_ = palette_colors_;
+  res.optimize_ = optimize_;
+  res.optimize_budget_ms_ = optimize_budget_ms_;
+  res.image_data_decompressed_nofilter_ = std::move(image_data_nofilter);
+  res.nofilter_valid_ = true;
+  res.resize_header(height, width);
+  return res;
+}
+
+std::vector<PNG> PNG::pyramid(const size_t& levels){
+  unset_filter();
+  std::vector<PNG> res;
+  res.reserve(levels);
+  // 各段は1つ前の段を2×2平均で縮小して作る
+  const std::vector<uint8_t>* src = &image_data_decompressed_nofilter_;
+  uint32_t height = height_;
+  uint32_t width = width_;
+  for(size_t level = 0; level < levels && height >= 2 && width >= 2; level++){
+    const size_t src_width_data = static_cast<size_t>(width) * 3 + 1;
+    height /= 2;
+    width /= 2;
+    const size_t dst_width_data = static_cast<size_t>(width) * 3 + 1;
+    std::vector<uint8_t> reduced(height * dst_width_data);
+    utils::parallel_for_bands(height, 64, [&](const size_t y_begin, const size_t y_end){
+      utils::reduce_half(
+        src->data() + y_begin * 2 * src_width_data, src_width_data,
+        reduced.data() + y_begin * dst_width_data, dst_width_data,
+        y_end - y_begin, width
+      );
+    });
+    res.push_back(derive(std::move(reduced), height, width));
+    src = &res.back().image_data_decompressed_nofilter_;
+  }
+  // 各段を別スレッドで通常のエンコード経路に通す
+  utils::parallel_for(res.size(), [&](const size_t i){
+    res[i].encode();
+  });
+  return res;
+}
 
+std::vector<PNG> PNG::thumbnails(const std::vector<std::pair<uint32_t, uint32_t>>& sizes){
+  unset_filter();
+  for(const std::pair<uint32_t, uint32_t>& size : sizes){
+    if(size.first == 0 || size.second == 0){
+      throw std::runtime_error("Thumbnail size must not be zero");
+    }
+  }
+  // 必要な段数だけ半分縮小を重ねる(エンコードはしない)。32ビット幅なら段は32以下なので要素は再配置されない
+  std::vector<PNG> levels;
+  levels.reserve(32);
+  const auto level_of = [&](const std::pair<uint32_t, uint32_t>& size) -> const PNG& {
+    const PNG* level = this;
+    for(size_t i = 0; level->height_ / 2 >= size.first && level->width_ / 2 >= size.second; i++){
+      if(i == levels.size()){
+        const size_t src_width_data = level->width_ * 3 + 1;
+        const uint32_t height = level->height_ / 2;
+        const uint32_t width = level->width_ / 2;
+        const size_t dst_width_data = static_cast<size_t>(width) * 3 + 1;
+        std::vector<uint8_t> reduced(height * dst_width_data);
+        utils::parallel_for_bands(height, 64, [&](const size_t y_begin, const size_t y_end){
+          utils::reduce_half(
+            level->image_data_decompressed_nofilter_.data() + y_begin * 2 * src_width_data, src_width_data,
+            reduced.data() + y_begin * dst_width_data, dst_width_data,
+            y_end - y_begin, width
+          );
+        });
+        levels.push_back(derive(std::move(reduced), height, width));
+      }
+      level = &levels[i];
+    }
+    return *level;
+  };
+  std::vector<const PNG*> sources(sizes.size());
+  for(size_t i = 0; i < sizes.size(); i++){
+    sources[i] = &level_of(sizes[i]);
+  }
+  // 最も近い段から目標サイズへ面積平均で合わせる
+  std::vector<std::vector<uint8_t>> resized(sizes.size());
+  utils::parallel_for(sizes.size(), [&](const size_t i){
+    const PNG& source = *sources[i];
+    const uint32_t height = sizes[i].first;
+    const uint32_t width = sizes[i].second;
+    resized[i] = (source.height_ == height && source.width_ == width)
+      ? source.image_data_decompressed_nofilter_
+      : utils::resample_area(
+          source.image_data_decompressed_nofilter_, source.height_, source.width_,
+          static_cast<double>(height) / source.height_, static_cast<double>(width) / source.width_, height, width
+        );
+  });
+  std::vector<PNG> res;
+  res.reserve(sizes.size());
+  for(size_t i = 0; i < sizes.size(); i++){
+    res.push_back(derive(std::move(resized[i]), sizes[i].first, sizes[i].second));
+  }
+  // 各サイズを別スレッドで通常のエンコード経路に通す
+  utils::parallel_for(res.size(), [&](const size_t i){
+    res[i].encode();
+  });
+  return res;
+}
 
+} // namespace png
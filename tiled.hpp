@@ -0,0 +1,470 @@
+# pragma once
+# include "png.hpp"
+# include <filesystem>
+# include <sys/mman.h>
+# include <fcntl.h>
+# include <unistd.h>
+
+namespace png {
+
+// スクラッチファイルをメモリマップした領域。ファイルは作成直後に削除するので、閉じれば消える
+class MappedFile{
+private:
+  int fd_ = -1;
+  uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+  void close(void){
+    if(data_ != nullptr) munmap(data_, size_);
+    if(fd_ != -1) ::close(fd_);
+    data_ = nullptr;
+    fd_ = -1;
+    size_ = 0;
+  }
+public:
+  MappedFile() = default;
+  MappedFile(const std::filesystem::path& directory, const size_t size) : size_(size){
+    std::string path_template = (directory / "png_scratch_XXXXXX").string();
+    fd_ = mkstemp(path_template.data());
+    if(fd_ == -1){
+      throw std::runtime_error("Failed to create scratch file");
+    }
+    unlink(path_template.c_str());
+    if(ftruncate(fd_, static_cast<off_t>(std::max<size_t>(size_, 1))) != 0){
+      close();
+      throw std::runtime_error("Failed to allocate scratch file");
+    }
+    void* mapped = mmap(nullptr, std::max<size_t>(size_, 1), PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if(mapped == MAP_FAILED){
+      close();
+      throw std::runtime_error("Failed to map scratch file");
+    }
+    data_ = static_cast<uint8_t*>(mapped);
+  }
+  ~MappedFile(){ close(); }
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  MappedFile(MappedFile&& other) noexcept
+    : fd_(std::exchange(other.fd_, -1)), data_(std::exchange(other.data_, nullptr)), size_(std::exchange(other.size_, 0)) {}
+  MappedFile& operator=(MappedFile&& other) noexcept{
+    if(this != &other){
+      close();
+      fd_ = std::exchange(other.fd_, -1);
+      data_ = std::exchange(other.data_, nullptr);
+      size_ = std::exchange(other.size_, 0);
+    }
+    return *this;
+  }
+  // [offset, offset+length)の常駐ページを手放す(内容はファイルに残り、次に触れたときに読み戻される)
+  void release(const size_t offset, const size_t length){
+    const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    const size_t begin = offset / page * page;
+    const size_t end = std::min(offset + length, size_) / page * page;
+    if(end <= begin) return;
+    msync(data_ + begin, end - begin, MS_ASYNC);
+    madvise(data_ + begin, end - begin, MADV_DONTNEED);
+  }
+  uint8_t* data() { return data_; }
+  const uint8_t* data() const { return data_; }
+  size_t size() const { return size_; }
+};
+
+// 行を受け取るたびにフィルター・圧縮してIDATチャンクとして書き出すエンコーダ
+class StreamEncoder{
+private:
+  static constexpr size_t IDAT_SIZE = 1 << 18; // 1つのIDATチャンクの最大データ長
+  std::ofstream ofs_;
+  z_stream strm_;
+  uint32_t width_ = 0;
+  uint32_t height_ = 0;
+  uint32_t rows_written_ = 0;
+  std::vector<uint8_t> prev_; // 1つ上の行(フィルター解除済み)
+  std::vector<uint8_t> cur_;
+  std::vector<uint8_t> filtered_;
+  std::vector<std::vector<uint8_t>> filtered_results_{5};
+  std::vector<uint8_t> idat_;
+  void write_chunk(const std::string& type, const uint8_t* data, const size_t size){
+    const std::vector<char> length_bytes = utils::int2vecchar(static_cast<uint32_t>(size));
+    ofs_.write(length_bytes.data(), 4);
+    ofs_.write(type.c_str(), 4);
+    ofs_.write(reinterpret_cast<const char*>(data), size);
+    uLong crc = crc32(0L, reinterpret_cast<const Bytef*>(type.c_str()), 4);
+    if(size > 0) crc = crc32(crc, data, static_cast<uInt>(size)); // dataがnullptrだとCRCが初期値に戻る
+    const std::vector<char> crc_bytes = utils::int2vecchar(static_cast<uint32_t>(crc));
+    ofs_.write(crc_bytes.data(), 4);
+  }
+  // 出力バッファに溜まった圧縮データをIDATチャンクとして書き出す
+  void flush_idat(void){
+    const size_t size = IDAT_SIZE - strm_.avail_out;
+    if(size > 0) write_chunk("IDAT", idat_.data(), size);
+    strm_.next_out = idat_.data();
+    strm_.avail_out = IDAT_SIZE;
+  }
+public:
+  // ancillaryはIHDRの後にそのまま書き出すチャンク
+  StreamEncoder(const std::string& path, const uint32_t width, const uint32_t height, const std::vector<Chunk>& ancillary)
+    : ofs_(path, std::ios::out | std::ios::binary), width_(width), height_(height){
+    if(!ofs_){
+      throw std::runtime_error("Failed to open output file");
+    }
+    const size_t width_data = static_cast<size_t>(width_) * 3 + 1;
+    prev_.resize(width_data);
+    cur_.resize(width_data);
+    filtered_.resize(width_data);
+    idat_.resize(IDAT_SIZE);
+    strm_.zalloc = Z_NULL;
+    strm_.zfree = Z_NULL;
+    strm_.opaque = Z_NULL;
+    if(deflateInit(&strm_, Z_DEFAULT_COMPRESSION) != Z_OK){
+      throw std::runtime_error("deflateInit failed");
+    }
+    strm_.next_out = idat_.data();
+    strm_.avail_out = IDAT_SIZE;
+    // PNGシグネチャとIHDR(8ビットRGB)
+    const unsigned char signature[] = {
+      0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A
+    };
+    ofs_.write(reinterpret_cast<const char*>(signature), 8);
+    IHDR ihdr;
+    ihdr.width() = width_;
+    ihdr.height() = height_;
+    ihdr.bit_depth() = 8;
+    ihdr.color_type() = 2;
+    const std::vector<char> ihdr_data = ihdr.get();
+    write_chunk("IHDR", reinterpret_cast<const uint8_t*>(ihdr_data.data()), ihdr_data.size());
+    for(const Chunk& chunk : ancillary){
+      write_chunk(chunk.type_string(), reinterpret_cast<const uint8_t*>(chunk.data_raw().data()), chunk.data_raw().size());
+    }
+  }
+  ~StreamEncoder(){ deflateEnd(&strm_); }
+  StreamEncoder(const StreamEncoder&) = delete;
+  StreamEncoder& operator=(const StreamEncoder&) = delete;
+  // 1行(先頭はフィルタタイプ用の1バイトで内容は無視)を追加
+  void write_row(const uint8_t* row){
+    if(rows_written_ >= height_){
+      throw std::runtime_error("Too many rows written");
+    }
+    std::copy(row + 1, row + cur_.size(), cur_.begin() + 1);
+    utils::filter_row(cur_.data(), rows_written_ > 0 ? prev_.data() : nullptr, filtered_.data(), cur_.size(), 5, filtered_results_);
+    strm_.next_in = filtered_.data();
+    strm_.avail_in = static_cast<uInt>(filtered_.size());
+    while(strm_.avail_in > 0){
+      if(deflate(&strm_, Z_NO_FLUSH) != Z_OK){
+        throw std::runtime_error("deflate failed");
+      }
+      if(strm_.avail_out == 0) flush_idat();
+    }
+    std::swap(prev_, cur_);
+    rows_written_++;
+  }
+  // 圧縮を終えてIENDまで書き出す
+  void finish(void){
+    if(rows_written_ != height_){
+      throw std::runtime_error("Not all rows were written");
+    }
+    int ret;
+    do{
+      ret = deflate(&strm_, Z_FINISH);
+      if(ret != Z_OK && ret != Z_STREAM_END){
+        throw std::runtime_error("deflate failed");
+      }
+      flush_idat();
+    }while(ret != Z_STREAM_END);
+    write_chunk("IEND", nullptr, 0);
+    ofs_.close();
+    if(!ofs_){
+      throw std::runtime_error("Failed to write output file");
+    }
+  }
+};
+
+// メモリに載らない大きな画像を扱うためのPNG。フィルター解除済みの画素をメモリマップしたスクラッチファイルに置き、
+// 各処理はmemory_budget程度の行帯ごとに進めて、処理済みの帯の常駐ページを手放す
+class TiledPNG{
+private:
+  std::filesystem::path scratch_directory_;
+  uint64_t memory_budget_ = 0;
+  uint32_t width_ = 0;
+  uint32_t height_ = 0;
+  bool modified_ = false;
+  bool fingerprint_enabled_ = false; // 解凍と同時に指紋を計算するかどうか
+  utils::FingerprintAccumulator fingerprint_rows_;
+  Fingerprint fingerprint_;
+  std::vector<Chunk> ancillary_; // IHDR, IDAT, pIdX, IEND以外のチャンク
+  MappedFile pixels_; // 行あたりwidth*3+1バイト(PNGクラスのフィルター解除済みデータと同じ配置)
+  size_t width_data(void) const { return static_cast<size_t>(width_) * 3 + 1; }
+  // 1行あたりbytes_per_rowバイトを触る処理で、全スレッド合わせて予算に収まる帯の行数
+  size_t band_rows(const size_t bytes_per_row) const{
+    const size_t num_threads = std::max(1u, std::thread::hardware_concurrency());
+    return std::max<size_t>(1, memory_budget_ / (bytes_per_row * num_threads));
+  }
+  void release_rows(MappedFile& file, const size_t width_data, const size_t y_begin, const size_t y_end){
+    file.release(y_begin * width_data, (y_end - y_begin) * width_data);
+  }
+  void decode(std::ifstream& ifs); // チャンクを順に読み、IDATを行単位で解凍・フィルター解除してスクラッチへ書く
+public:
+  // fingerprintがtrueなら、PNGクラスと同じ指紋を解凍中に行ごとに計算する
+  TiledPNG(const std::string& path, const std::filesystem::path& scratch_directory, const uint64_t& memory_budget, const bool& fingerprint = false);
+  const Fingerprint& fingerprint(void) const { return fingerprint_; } // 読み込んだ時点の画素の指紋
+  void reverse_color(void);
+  void apply(const PointwiseOps& ops);
+  void flip_horizontal(void);
+  void flip_vertical(void);
+  void crop(const uint32_t& y, const uint32_t& x, const uint32_t& height, const uint32_t& width);
+  void resize_data(const double& scale_height, const double& scale_width);
+  void write(const std::string& path);
+  uint32_t width(void) const { return width_; }
+  uint32_t height(void) const { return height_; }
+};
+
+TiledPNG::TiledPNG(const std::string& path, const std::filesystem::path& scratch_directory, const uint64_t& memory_budget, const bool& fingerprint)
+  : scratch_directory_(scratch_directory), memory_budget_(memory_budget), fingerprint_enabled_(fingerprint){
+  std::ifstream ifs(path, std::ios::in | std::ios::binary);
+  if(!ifs){
+    throw std::runtime_error("Failed to open input file");
+  }
+  char signature[8];
+  ifs.read(signature, 8);
+  if(!ifs || std::memcmp(signature, "\x89PNG\r\n\x1a\n", 8) != 0){
+    throw std::runtime_error("Not a PNG file");
+  }
+  decode(ifs);
+}
+
+void TiledPNG::decode(std::ifstream& ifs){
+  z_stream strm;
+  strm.zalloc = Z_NULL;
+  strm.zfree = Z_NULL;
+  strm.opaque = Z_NULL;
+  strm.avail_in = 0;
+  strm.next_in = Z_NULL;
+  bool inflating = false;
+  int ret = Z_OK;
+  size_t rows_done = 0; // フィルター解除まで済んだ行数
+  size_t rows_released = 0;
+  size_t out_left = 0;
+  size_t band = 1;
+  std::vector<char> buffer(1 << 16);
+  while(true){
+    char header[8];
+    ifs.read(header, 8);
+    if(!ifs){
+      if(inflating) inflateEnd(&strm);
+      throw std::runtime_error("Unexpected end of file");
+    }
+    const uint32_t length = utils::vecchar2int(header);
+    const uint32_t type = utils::vecchar2int(header + 4);
+    if(type == TYPE_IDAT){
+      if(pixels_.size() == 0){
+        throw std::runtime_error("IDAT before IHDR");
+      }
+      if(!inflating){
+        if(inflateInit(&strm) != Z_OK){
+          throw std::runtime_error("inflateInit failed");
+        }
+        inflating = true;
+        strm.next_out = pixels_.data();
+        strm.avail_out = 0;
+        out_left = pixels_.size();
+        band = band_rows(width_data());
+      }
+      // IDATは一度に読まず、小さなバッファ単位で解凍する
+      uLong crc = crc32(0L, reinterpret_cast<const Bytef*>(header + 4), 4);
+      for(uint32_t left = length; left > 0; ){
+        const uint32_t size = std::min<uint32_t>(left, buffer.size());
+        ifs.read(buffer.data(), size);
+        if(!ifs){
+          inflateEnd(&strm);
+          throw std::runtime_error("Unexpected end of file");
+        }
+        crc = crc32(crc, reinterpret_cast<const Bytef*>(buffer.data()), size);
+        left -= size;
+        strm.next_in = reinterpret_cast<Bytef*>(buffer.data());
+        strm.avail_in = size;
+        while(strm.avail_in > 0 && ret == Z_OK){
+          if(strm.avail_out == 0 && out_left > 0){
+            strm.avail_out = static_cast<uInt>(std::min<size_t>(out_left, UINT32_MAX));
+            out_left -= strm.avail_out;
+          }
+          // 出力先が埋まってもまだ入力が残っていればZ_BUF_ERRORのまま抜けてエラーにする
+          ret = inflate(&strm, Z_NO_FLUSH);
+          // 揃った行から順にその場でフィルター解除
+          const size_t rows_ready = (static_cast<size_t>(strm.next_out - pixels_.data())) / width_data();
+          for(; rows_done < rows_ready; rows_done++){
+            uint8_t* row = pixels_.data() + rows_done * width_data();
+            utils::unfilter_row(row, rows_done > 0 ? row - width_data() : nullptr, row, width_data());
+            // 手放す前の、キャッシュにあるうちに指紋へ取り込む
+            if(fingerprint_enabled_){
+              fingerprint_rows_.add_row(rows_done, row + 1);
+            }
+          }
+          // 直前の1行は次の行の復元に使うので残す
+          if(rows_done > rows_released + band + 1){
+            release_rows(pixels_, width_data(), rows_released, rows_done - 1);
+            rows_released = rows_done - 1;
+          }
+        }
+        if(ret != Z_OK && ret != Z_STREAM_END){
+          inflateEnd(&strm);
+          throw std::runtime_error("inflate failed");
+        }
+      }
+      char crc_bytes[4];
+      ifs.read(crc_bytes, 4);
+      assert(utils::vecchar2int(crc_bytes) == crc);
+      continue;
+    }
+    // IDAT以外のチャンクは丸ごと読んで解析する
+    std::vector<char> chunk_data(BYTE_LENGTH + BYTE_TYPE + length + BYTE_CRC);
+    std::copy(header, header + 8, chunk_data.begin());
+    ifs.read(chunk_data.data() + 8, length + BYTE_CRC);
+    if(!ifs){
+      if(inflating) inflateEnd(&strm);
+      throw std::runtime_error("Unexpected end of file");
+    }
+    Chunk chunk;
+    chunk.set(chunk_data);
+    if(type == TYPE_IHDR){
+      const IHDR& ihdr = std::get<IHDR>(chunk.data());
+      if(ihdr.bit_depth() != 8 || ihdr.color_type() != 2 || ihdr.interlace_method() != 0){
+        throw std::runtime_error("Only non-interlaced 8-bit RGB is supported");
+      }
+      width_ = ihdr.width();
+      height_ = ihdr.height();
+      pixels_ = MappedFile(scratch_directory_, static_cast<size_t>(height_) * width_data());
+      if(fingerprint_enabled_){
+        fingerprint_rows_.prepare(height_, width_);
+      }
+    }else if(type == TYPE_IEND){
+      break;
+    }else if(type != TYPE_pIdX && type != TYPE_pIDX && type != TYPE_acTL && type != TYPE_fcTL && type != TYPE_fdAT){
+      // 索引とAPNGのフレームは既定画像だけを扱うこのクラスでは引き継げない
+      ancillary_.push_back(std::move(chunk));
+    }
+  }
+  if(inflating) inflateEnd(&strm);
+  if(ret != Z_STREAM_END || rows_done != height_){
+    throw std::runtime_error("inflate failed");
+  }
+  release_rows(pixels_, width_data(), rows_released, rows_done);
+  if(fingerprint_enabled_){
+    fingerprint_ = fingerprint_rows_.finalize();
+  }
+}
+
+void TiledPNG::reverse_color(void){
+  apply(PointwiseOps{}.invert());
+}
+
+void TiledPNG::apply(const PointwiseOps& ops){
+  const std::vector<PointwiseOps::Stage>& stages = ops.stages();
+  utils::parallel_for_bands(height_, band_rows(width_data()), [&](const size_t y_begin, const size_t y_end){
+    for(size_t y = y_begin; y < y_end; y++){
+      utils::apply_pointwise_row(stages, pixels_.data() + y * width_data() + 1, width_);
+    }
+    release_rows(pixels_, width_data(), y_begin, y_end);
+  });
+  modified_ = true;
+}
+
+void TiledPNG::flip_horizontal(void){
+  utils::parallel_for_bands(height_, band_rows(width_data()), [&](const size_t y_begin, const size_t y_end){
+    std::vector<uint8_t> flipped(width_data());
+    for(size_t y = y_begin; y < y_end; y++){
+      uint8_t* row = pixels_.data() + y * width_data() + 1;
+      utils::reverse_pixels(row, flipped.data() + 1, width_);
+      std::memcpy(row, flipped.data() + 1, static_cast<size_t>(width_) * 3);
+    }
+    release_rows(pixels_, width_data(), y_begin, y_end);
+  });
+  modified_ = true;
+}
+
+void TiledPNG::flip_vertical(void){
+  // 上半分の帯と、それに対応する下半分の帯の行を入れ替える
+  utils::parallel_for_bands(height_ / 2, band_rows(width_data() * 2), [&](const size_t y_begin, const size_t y_end){
+    for(size_t y = y_begin; y < y_end; y++){
+      uint8_t* top = pixels_.data() + y * width_data();
+      uint8_t* bottom = pixels_.data() + (height_ - 1 - y) * width_data();
+      std::swap_ranges(top, top + width_data(), bottom);
+    }
+    release_rows(pixels_, width_data(), y_begin, y_end);
+    release_rows(pixels_, width_data(), height_ - y_end, height_ - y_begin);
+  });
+  modified_ = true;
+}
+
+void TiledPNG::crop(const uint32_t& y, const uint32_t& x, const uint32_t& height, const uint32_t& width){
+  if(height == 0 || width == 0 || y > height_ || x > width_ || height > height_ - y || width > width_ - x){
+    throw std::runtime_error("Crop region is out of range");
+  }
+  const size_t dst_width_data = static_cast<size_t>(width) * 3 + 1;
+  MappedFile cropped(scratch_directory_, height * dst_width_data);
+  utils::parallel_for_bands(height, band_rows(width_data() + dst_width_data), [&](const size_t y_begin, const size_t y_end){
+    for(size_t h = y_begin; h < y_end; h++){
+      std::memcpy(
+        cropped.data() + h * dst_width_data + 1,
+        pixels_.data() + (y + h) * width_data() + 1 + x * 3,
+        static_cast<size_t>(width) * 3
+      );
+    }
+    release_rows(pixels_, width_data(), y + y_begin, y + y_end);
+    release_rows(cropped, dst_width_data, y_begin, y_end);
+  });
+  pixels_ = std::move(cropped);
+  height_ = height;
+  width_ = width;
+  modified_ = true;
+}
+
+void TiledPNG::resize_data(const double& scale_height, const double& scale_width){
+  const uint32_t height_resized = static_cast<uint32_t>(height_ * scale_height);
+  const uint32_t width_resized = static_cast<uint32_t>(width_ * scale_width);
+  const size_t dst_width_data = static_cast<size_t>(width_resized) * 3 + 1;
+  MappedFile resized(scratch_directory_, height_resized * dst_width_data);
+  // 出力1行あたりに触る元画像の行数を見込んで帯の大きさを決める
+  const size_t src_rows_per_row = static_cast<size_t>(std::ceil(1.0 / scale_height)) + 1;
+  const size_t band = band_rows(dst_width_data + src_rows_per_row * width_data());
+  utils::parallel_for_bands(height_resized, band, [&](const size_t y_begin, const size_t y_end){
+    utils::resample_area_rows(
+      pixels_.data(), height_, width_, scale_height, scale_width, width_resized,
+      y_begin, y_end, resized.data() + y_begin * dst_width_data
+    );
+    const size_t src_begin = static_cast<size_t>(y_begin / scale_height);
+    const size_t src_end = std::min<size_t>(static_cast<size_t>(y_end / scale_height) + 1, height_);
+    release_rows(pixels_, width_data(), src_begin, src_end);
+    release_rows(resized, dst_width_data, y_begin, y_end);
+  });
+  pixels_ = std::move(resized);
+  height_ = height_resized;
+  width_ = width_resized;
+  modified_ = true;
+}
+
+void TiledPNG::write(const std::string& path){
+  std::vector<Chunk> ancillary = ancillary_;
+  if(modified_){
+    Chunk text_chunk;
+    const std::string keyword = "ImageProcesser";
+    const std::string text = "Tamagosushio";
+    text_chunk.type() = TYPE_tEXt;
+    text_chunk.type_string() = "tEXt";
+    text_chunk.data_raw().assign(keyword.begin(), keyword.end());
+    text_chunk.data_raw().push_back(0x00);
+    text_chunk.data_raw().insert(text_chunk.data_raw().end(), text.begin(), text.end());
+    text_chunk.length() = text_chunk.data_raw().size();
+    ancillary.push_back(text_chunk);
+  }
+  // 圧縮は逐次なので、帯ごとに書き出して常駐ページを手放す
+  StreamEncoder encoder(path, width_, height_, ancillary);
+  const size_t band = band_rows(width_data());
+  for(size_t y_begin = 0; y_begin < height_; y_begin += band){
+    const size_t y_end = std::min<size_t>(y_begin + band, height_);
+    for(size_t y = y_begin; y < y_end; y++){
+      encoder.write_row(pixels_.data() + y * width_data());
+    }
+    release_rows(pixels_, width_data(), y_begin, y_end);
+  }
+  encoder.finish();
+}
+
+} // namespace png